@@ -0,0 +1,117 @@
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "corpus.hxx"
+#include "sqlite.hxx"
+#include "tagfs.hxx"
+
+static constexpr uint64_t files_per_dir = 1000;
+
+/* past this many draws in a row already on the file, a file keeps fewer tags */
+static constexpr int max_redraws = 64;
+
+static auto format(const char *fmt, uint64_t n) -> std::string {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), fmt, static_cast<unsigned long long>(n));
+    return buf;
+}
+
+auto Corpus::file_name(uint64_t id) -> std::string {
+    return format("f%07llu", id);
+}
+
+auto Corpus::file_path(uint64_t id) -> std::string {
+    return format("d%04llu/", (id - 1) / files_per_dir) + file_name(id);
+}
+
+auto Corpus::tag_name(uint64_t id) -> std::string {
+    return format("tag%05llu", id);
+}
+
+auto Corpus::option(std::string_view arg) -> bool {
+    auto eq = arg.find('=');
+    if (arg.substr(0, 2) != "--" || eq == std::string_view::npos)
+        return false;
+    auto name = arg.substr(2, eq - 2);
+    auto value = std::string(arg.substr(eq + 1));
+
+    std::size_t end = 0;
+    try {
+        if (name == "files")
+            files = std::stoull(value, &end);
+        else if (name == "tags")
+            tags = std::stoull(value, &end);
+        else if (name == "tags-per-file")
+            tags_per_file = std::stoull(value, &end);
+        else if (name == "zipf")
+            zipf = std::stod(value, &end);
+        else if (name == "seed")
+            seed = std::stoull(value, &end);
+        else
+            return false;
+    } catch (const std::logic_error &) {
+        return false;
+    }
+    return end == value.size();
+}
+
+Zipf::Zipf(uint64_t n, double s) {
+    if (n == 0)
+        throw std::invalid_argument("no tags to draw from");
+    cdf.reserve(n);
+    double sum = 0;
+    for (uint64_t k = 1; k <= n; k++)
+        cdf.push_back(sum += 1 / std::pow(double(k), s));
+}
+
+auto Corpus::generate(const std::filesystem::path &datadir) const -> void {
+    std::filesystem::create_directories(datadir);
+    if (!std::filesystem::is_empty(datadir))
+        throw std::runtime_error("not an empty directory: " + datadir.string());
+
+    for (uint64_t id = 1; id <= files; id++) {
+        auto path = datadir / file_path(id);
+        if ((id - 1) % files_per_dir == 0)
+            std::filesystem::create_directory(path.parent_path());
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "failed to create " + path.string());
+        ::close(fd);
+    }
+
+    SQLite db((datadir / ".yatagfs.db").c_str());
+    TagFS::create_schema(db);
+
+    std::mt19937_64 random(seed);
+    Zipf zipf(tags, this->zipf);
+    auto per_file = std::min(tags_per_file, tags);
+
+    db.exec("begin");
+    for (uint64_t id = 1; id <= tags; id++)
+        db.prepare_bind("insert into tags (id, name) values (?, ?)",
+                        static_cast<int64_t>(id), std::string_view(tag_name(id))).exec();
+
+    std::unordered_set<uint64_t> chosen;
+    for (uint64_t id = 1; id <= files; id++) {
+        db.prepare_bind("insert into files (id, path, name) values (?, ?, ?)",
+                        static_cast<int64_t>(id),
+                        std::string_view(file_path(id)),
+                        std::string_view(file_name(id))).exec();
+
+        chosen.clear();
+        for (int redraws = 0; chosen.size() < per_file && redraws < max_redraws;) {
+            if (!chosen.insert(zipf(random)).second)
+                redraws++;
+        }
+        for (auto tag : chosen)
+            db.prepare_bind("insert into files_tags (file_id, tag_id) values (?, ?)",
+                            static_cast<int64_t>(id), static_cast<int64_t>(tag)).exec();
+    }
+    db.exec("commit");
+}
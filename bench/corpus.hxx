@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * A synthetic data directory: `files` empty files spread over
+ * subdirectories of 1000, and `tags` tags handed out with a Zipf
+ * distribution, so a few tags are on most files and most tags on a few.
+ * Tag `k` (from 1) is chosen with a weight of 1 / k^zipf.
+ *
+ * Everything goes straight into `.yatagfs.db`, the way a mount would
+ * have left it, except for `dirs`: the first mount still lists every
+ * directory once and finds nothing to change.
+ */
+struct Corpus {
+    uint64_t files = 100000;
+    uint64_t tags = 1000;
+    uint64_t tags_per_file = 8;
+    double zipf = 1.0;
+    uint64_t seed = 1;
+
+    /* the names the generator gives to file and tag `id` */
+    static auto file_name(uint64_t id) -> std::string;
+    static auto file_path(uint64_t id) -> std::string;
+    static auto tag_name(uint64_t id) -> std::string;
+
+    /* take `--files=N`, `--tags=N`, `--tags-per-file=N`, `--zipf=S` or `--seed=N` */
+    auto option(std::string_view arg) -> bool;
+
+    auto generate(const std::filesystem::path &datadir) const -> void;
+};
+
+/* draws tag ids, from 1, with the weights of a `Corpus` */
+class Zipf {
+    std::vector<double> cdf;
+
+public:
+    Zipf(uint64_t n, double s);
+
+    template<typename G>
+    auto operator()(G &g) const -> uint64_t;
+};
+
+template<typename G>
+auto Zipf::operator()(G &g) const -> uint64_t {
+    auto u = std::uniform_real_distribution<double>(0, cdf.back())(g);
+    auto it = std::upper_bound(cdf.begin(), cdf.end(), u);
+    return std::min<uint64_t>(it - cdf.begin(), cdf.size() - 1) + 1;
+}
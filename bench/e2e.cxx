@@ -0,0 +1,204 @@
+/*
+ * The whole filesystem, mounted over a generated corpus: getattr of
+ * files not looked up before, listings of tag directories, and tags
+ * added and removed with link(2) and unlink(2), each at several thread
+ * counts.
+ *
+ * Takes the `yatagfs` executable to run. Exits with 77, which meson
+ * counts as skipped, where FUSE is not available.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "corpus.hxx"
+#include "harness.hxx"
+
+static constexpr int skipped = 77;
+
+static constexpr unsigned thread_counts[] = {1, 2, 4, 8};
+static constexpr uint64_t stat_ops = 10000;
+static constexpr uint64_t readdir_ops = 2000;
+static constexpr uint64_t write_ops = 2000;
+static constexpr std::chrono::seconds mount_timeout{60};
+
+static auto in_path(const char *program) -> bool {
+    const char *path = std::getenv("PATH");
+    std::string_view dirs = path ? path : "/usr/bin:/bin";
+    while (!dirs.empty()) {
+        auto colon = dirs.find(':');
+        auto dir = std::string(dirs.substr(0, colon));
+        if (access((dir + "/" + program).c_str(), X_OK) == 0)
+            return true;
+        dirs.remove_prefix(colon == std::string_view::npos ? dirs.size() : colon + 1);
+    }
+    return false;
+}
+
+static auto spawn(const std::vector<std::string> &args) -> pid_t {
+    std::vector<char *> argv;
+    for (auto &arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        throw std::system_error(errno, std::generic_category(), "fork");
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        std::perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static auto device(const std::filesystem::path &path) -> dev_t {
+    struct stat sb;
+    if (stat(path.c_str(), &sb) != 0)
+        throw std::system_error(errno, std::generic_category(), "failed to stat " + path.string());
+    return sb.st_dev;
+}
+
+/* mounted once `mountpoint` is on another device than its parent */
+static auto wait_mounted(pid_t pid, const std::filesystem::path &mountpoint) -> void {
+    auto parent = device(mountpoint.parent_path());
+    auto deadline = std::chrono::steady_clock::now() + mount_timeout;
+    while (device(mountpoint) == parent) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            throw std::runtime_error("yatagfs exited before mounting");
+        if (std::chrono::steady_clock::now() > deadline)
+            throw std::runtime_error("timed out waiting for the mount");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+static auto run(const Corpus &corpus, const std::filesystem::path &mnt) -> void {
+    /* every round stats files no earlier one did, so none is in the kernel's cache yet */
+    uint64_t next_file = 0;
+    auto writes = std::min(write_ops, corpus.files);
+
+    /* ops run on worker threads, which must not throw */
+    std::atomic<uint64_t> failed{0};
+    auto check = [&](bool ok) {
+        if (!ok)
+            failed++;
+    };
+    auto checked = [&](const char *what) {
+        if (failed)
+            throw std::runtime_error(std::to_string(failed.load()) + " calls failed in " + what);
+    };
+
+    for (auto threads : thread_counts) {
+        auto first = next_file;
+        next_file += stat_ops;
+        measure("getattr", threads, stat_ops, [&](unsigned, uint64_t i) {
+            struct stat sb;
+            check(stat((mnt / Corpus::file_name((first + i) % corpus.files + 1)).c_str(), &sb) == 0);
+        });
+        checked("getattr");
+
+        measure("readdir", threads, readdir_ops, [&](unsigned, uint64_t i) {
+            auto dir = opendir((mnt / Corpus::tag_name(mix(i) % corpus.tags + 1)).c_str());
+            check(dir);
+            if (!dir)
+                return;
+            while (readdir(dir))
+                ;
+            closedir(dir);
+        });
+        checked("readdir");
+
+        /* a tag of its own each round, which no file carries yet */
+        auto tag = mnt / ("bench-" + std::to_string(threads));
+        check(mkdir(tag.c_str(), 0755) == 0);
+        checked("mkdir");
+
+        measure("tag_add", threads, writes, [&](unsigned, uint64_t i) {
+            auto name = Corpus::file_name(i + 1);
+            check(link((mnt / name).c_str(), (tag / name).c_str()) == 0);
+        });
+        checked("tag_add");
+
+        measure("tag_remove", threads, writes, [&](unsigned, uint64_t i) {
+            check(unlink((tag / Corpus::file_name(i + 1)).c_str()) == 0);
+        });
+        checked("tag_remove");
+    }
+}
+
+auto main(int argc, char **argv) -> int {
+    Corpus corpus;
+    const char *yatagfs = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (corpus.option(argv[i]))
+            continue;
+        if (yatagfs || argv[i][0] == '-') {
+            std::fprintf(stderr,
+                         "usage: %s yatagfs [--files=N] [--tags=N] [--tags-per-file=N] [--zipf=S] [--seed=N]\n",
+                         argv[0]);
+            return 2;
+        }
+        yatagfs = argv[i];
+    }
+    if (!yatagfs) {
+        std::fprintf(stderr, "%s: the yatagfs executable to run is needed\n", argv[0]);
+        return 2;
+    }
+
+    if (access("/dev/fuse", R_OK | W_OK) != 0 || !in_path("fusermount3")) {
+        std::fprintf(stderr, "%s: FUSE is not available, skipping\n", argv[0]);
+        return skipped;
+    }
+
+    std::filesystem::path base;
+    pid_t pid = -1;
+    bool mounted = false;
+    int res = 0;
+    try {
+        base = scratch_dir("yatagfs-e2e");
+        auto data = base / "data", mnt = base / "mnt";
+        std::filesystem::create_directory(mnt);
+        corpus.generate(data);
+
+        pid = spawn({yatagfs, data, mnt, "-f"});
+        wait_mounted(pid, mnt);
+        mounted = true;
+
+        run(corpus, mnt);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        res = 1;
+    }
+
+    if (mounted) {
+        int status;
+        waitpid(spawn({"fusermount3", "-u", base / "mnt"}), &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::fprintf(stderr, "%s: failed to unmount %s\n", argv[0], (base / "mnt").c_str());
+            mounted = false;
+            res = 1;
+        }
+    }
+    if (pid > 0) {
+        /* it exits by itself once unmounted */
+        if (!mounted)
+            kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    if (!base.empty())
+        std::filesystem::remove_all(base);
+    return res;
+}
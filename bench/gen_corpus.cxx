@@ -0,0 +1,40 @@
+/*
+ * Fill an empty data directory with a synthetic corpus, see `Corpus`.
+ */
+
+#include <cstdio>
+#include <exception>
+#include <optional>
+#include <string_view>
+
+#include "corpus.hxx"
+
+auto main(int argc, char **argv) -> int {
+    Corpus corpus;
+    std::optional<std::filesystem::path> datadir;
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (corpus.option(arg))
+            continue;
+        if (datadir || arg.substr(0, 1) == "-") {
+            std::fprintf(stderr,
+                         "usage: %s datadir [--files=N] [--tags=N] [--tags-per-file=N] [--zipf=S] [--seed=N]\n",
+                         argv[0]);
+            return 2;
+        }
+        datadir = arg;
+    }
+    if (!datadir) {
+        std::fprintf(stderr, "%s: no data directory given\n", argv[0]);
+        return 2;
+    }
+
+    try {
+        corpus.generate(*datadir);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
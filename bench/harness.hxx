@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "stats.hxx"
+
+/* a new empty directory under `$TMPDIR`, which the caller removes */
+inline auto scratch_dir(const char *name) -> std::filesystem::path {
+    auto path = (std::filesystem::temp_directory_path() / name).string() + ".XXXXXX";
+    if (!mkdtemp(path.data()))
+        throw std::system_error(errno, std::generic_category(), "failed to create " + path);
+    return path;
+}
+
+/* scrambles `x`, to draw something different on every call to an op */
+inline auto mix(uint64_t x) -> uint64_t {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+/*
+ * Runs `op(thread, i)` `ops` times in total, split over `threads`
+ * threads, and prints the latency percentiles of a single call and the
+ * throughput of all of them together.
+ */
+template<typename F>
+auto measure(const char *what, unsigned threads, uint64_t ops, F &&op) -> void {
+    std::vector<std::vector<uint64_t>> latencies(threads);
+    std::vector<std::thread> workers;
+
+    auto start = Stats::now();
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            auto &mine = latencies[t];
+            mine.reserve(ops / threads + 1);
+            for (uint64_t i = t; i < ops; i += threads) {
+                auto before = Stats::now();
+                op(t, i);
+                mine.push_back(Stats::now() - before);
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    auto elapsed = Stats::now() - start;
+
+    std::vector<uint64_t> all;
+    all.reserve(ops);
+    for (auto &mine : latencies)
+        all.insert(all.end(), mine.begin(), mine.end());
+    std::sort(all.begin(), all.end());
+    if (all.empty())
+        return;
+
+    auto at = [&](double q) -> double {
+        return all[std::min<std::size_t>(q * all.size(), all.size() - 1)] / 1e3;
+    };
+    std::printf("%-16s %2u threads %10.0f ops/s   p50 %9.1f us   p90 %9.1f us   p99 %9.1f us   max %9.1f us\n",
+                what, threads, all.size() / (elapsed / 1e9),
+                at(0.5), at(0.9), at(0.99), at(1));
+    std::fflush(stdout);
+}
@@ -0,0 +1,151 @@
+/*
+ * The queries a mount answers requests with, run in-process against a
+ * generated corpus: each through its own reader lease, the way a request
+ * gets one, and tag writes through the group commit.
+ *
+ * `TagFS` itself mounts when constructed, so this drives the layers
+ * beneath it; `e2e` measures the whole thing.
+ */
+
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "corpus.hxx"
+#include "harness.hxx"
+#include "index.hxx"
+#include "query.hxx"
+#include "sqlite.hxx"
+
+static constexpr unsigned thread_counts[] = {1, 2, 4, 8};
+static constexpr uint64_t read_ops = 20000;
+static constexpr uint64_t write_ops = 2000;
+static constexpr int64_t page = 1024;
+
+static auto run(const Corpus &corpus, const std::filesystem::path &datadir) -> void {
+    corpus.generate(datadir);
+
+    SQLite::Pool db(datadir / ".yatagfs.db");
+    TagIndex index;
+    index.load(*db.reader());
+
+    int datadirfd = ::open(datadir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (datadirfd < 0)
+        throw std::system_error(errno, std::generic_category(), "failed to open datadir");
+
+    auto file = [&](uint64_t i) -> int64_t { return mix(i) % corpus.files + 1; };
+    auto tag = [&](uint64_t i) -> int64_t { return mix(i) % corpus.tags + 1; };
+    /* among the `n` most common tags, which have the longest postings */
+    auto head_tag = [&](uint64_t i, uint64_t n) -> int64_t {
+        return mix(i) % std::min(n, corpus.tags) + 1;
+    };
+    auto tag_id = [&](SQLite &conn, std::string_view name) -> std::optional<int64_t> {
+        auto stmt = conn.prepare_bind("select id from tags where name = ?", name);
+        if (auto row = stmt.step())
+            return row->column_int64(0);
+        return {};
+    };
+
+    for (auto threads : thread_counts) {
+        measure("tag_id", threads, read_ops, [&](unsigned, uint64_t i) {
+            auto conn = db.reader();
+            tag_id(*conn, Corpus::tag_name(tag(i)));
+        });
+
+        measure("file_by_name", threads, read_ops, [&](unsigned, uint64_t i) {
+            auto conn = db.reader();
+            auto stmt = conn->prepare_bind("select id from files where name = ? order by id limit 1",
+                                           std::string_view(Corpus::file_name(file(i))));
+            stmt.step();
+        });
+
+        measure("file_attr", threads, read_ops, [&](unsigned, uint64_t i) {
+            auto conn = db.reader();
+            auto stmt = conn->prepare_bind("select path from files where id = ?", file(i));
+            struct stat sb;
+            if (auto row = stmt.step())
+                fstatat(datadirfd, row->column_text(0).data(), &sb, AT_SYMLINK_NOFOLLOW);
+        });
+
+        measure("tags_page", threads, read_ops, [&](unsigned, uint64_t i) {
+            auto conn = db.reader();
+            uint64_t sum = 0;
+            for (auto [id, name] : conn->prepare_bind("select id, name from tags where id > ? order by id limit ?",
+                                                      tag(i) - 1, page)
+                                       .rows<int64_t, std::string_view>())
+                sum += id + name.size();
+        });
+
+        measure("intersect", threads, read_ops, [&](unsigned, uint64_t i) {
+            index.intersect({head_tag(i, 10), head_tag(~i, 10)});
+        });
+
+        measure("intersect_page", threads, read_ops, [&](unsigned, uint64_t i) {
+            index.intersect({head_tag(i, 10), head_tag(~i, 10)}, file(i), page);
+        });
+
+        measure("query", threads, read_ops, [&](unsigned, uint64_t i) {
+            auto text = Corpus::tag_name(head_tag(i, 20)) + "+" + Corpus::tag_name(head_tag(~i, 20))
+                + "-" + Corpus::tag_name(head_tag(i + 1, 5)) + "," + Corpus::tag_name(tag(i + 2));
+            auto conn = db.reader();
+            auto plan = Query::parse(text)->plan([&](std::string_view name) { return tag_id(*conn, name); });
+            Query::run(plan, index, [&](int64_t after, std::size_t limit) {
+                std::vector<int64_t> files;
+                for (auto [id] : conn->prepare_bind("select id from files where id > ? order by id limit ?",
+                                                    after, static_cast<int64_t>(limit))
+                                     .rows<int64_t>())
+                    files.push_back(id);
+                return files;
+            }, 0, page);
+        });
+
+        /* a tag of its own each round, so that every write adds a row */
+        int64_t bench_tag;
+        db.commit([&](SQLite &conn) -> std::function<void()> {
+            conn.prepare_bind("insert into tags (name) values (?)",
+                              std::string_view("bench-" + std::to_string(threads))).exec();
+            bench_tag = sqlite3_last_insert_rowid(conn.db);
+            return {};
+        });
+        measure("tag_write", threads, write_ops, [&](unsigned, uint64_t i) {
+            auto id = static_cast<int64_t>(i % corpus.files + 1);
+            db.commit([&](SQLite &conn) -> std::function<void()> {
+                conn.prepare_bind("insert or ignore into files_tags (file_id, tag_id) values (?, ?)",
+                                  id, bench_tag).exec();
+                return [&] { index.add(id, bench_tag); };
+            });
+        });
+    }
+
+    ::close(datadirfd);
+}
+
+auto main(int argc, char **argv) -> int {
+    Corpus corpus;
+    for (int i = 1; i < argc; i++) {
+        if (!corpus.option(argv[i])) {
+            std::fprintf(stderr,
+                         "usage: %s [--files=N] [--tags=N] [--tags-per-file=N] [--zipf=S] [--seed=N]\n",
+                         argv[0]);
+            return 2;
+        }
+    }
+
+    std::filesystem::path datadir;
+    try {
+        datadir = scratch_dir("yatagfs-bench");
+        run(corpus, datadir);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        if (!datadir.empty())
+            std::filesystem::remove_all(datadir);
+        return 1;
+    }
+    std::filesystem::remove_all(datadir);
+    return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Decoding rows: `Stmt::rows` and `Stmt::iterate` against the recursive
+ * `std::function` wrappers `iterate` used to go through, on the query a
+ * directory listing runs once per page.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "sqlite.hxx"
+
+static std::atomic<uint64_t> allocations = 0;
+
+auto operator new(std::size_t size) -> void * {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+auto operator delete(void *p) noexcept -> void {
+    std::free(p);
+}
+
+auto operator delete(void *p, [[maybe_unused]] std::size_t size) noexcept -> void {
+    std::free(p);
+}
+
+/* what `Row::call` did before: one `std::function` per column, per row */
+template<typename F>
+static auto legacy_call(SQLite::Row &row, int n, F &&f) -> void;
+
+static auto legacy_call_(
+    [[maybe_unused]] SQLite::Row &row,
+    [[maybe_unused]] int n,
+    std::function<auto() -> void> f
+) -> void {
+    f();
+}
+
+template<typename... TS>
+static auto legacy_call_(
+    SQLite::Row &row,
+    int n,
+    std::function<auto(int64_t, TS...) -> void> f
+) -> void {
+    auto c = row.column_int64(n);
+    legacy_call(row, n + 1, [=](TS... args) -> void {
+        f(c, args...);
+    });
+}
+
+template<typename... TS>
+static auto legacy_call_(
+    SQLite::Row &row,
+    int n,
+    std::function<auto(std::optional<std::string_view>, TS...) -> void> f
+) -> void {
+    auto c = row.column_text(n);
+    legacy_call(row, n + 1, [=](TS... args) -> void {
+        f(c, args...);
+    });
+}
+
+template<typename F>
+static auto legacy_call(SQLite::Row &row, int n, F &&f) -> void {
+    legacy_call_(row, n, std::function(f));
+}
+
+static constexpr int64_t row_count = 200000;
+static constexpr int rounds = 10;
+
+static const char *query = "select id, name from files order by id";
+
+template<typename F>
+static auto measure(const char *what, SQLite &db, F &&decode) -> void {
+    uint64_t sum = 0;
+    /* warm the page cache and the statement cache */
+    decode(db, sum);
+
+    auto before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+        decode(db, sum);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto allocated = allocations.load() - before;
+
+    double rows = double(row_count) * rounds;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::printf("%-10s %8.1f ns/row %12.0f rows/s %8.2f allocations/row (checksum %llu)\n",
+                what, ns / rows, rows / ns * 1e9, allocated / rows,
+                static_cast<unsigned long long>(sum));
+}
+
+auto main() -> int {
+    SQLite db(":memory:");
+    db.exec(R"(
+create table files
+    ( id integer primary key not null
+    , name text not null
+    );
+)");
+
+    db.exec("begin");
+    {
+        auto stmt = db.prepare("insert into files (id, name) values (?, ?)");
+        std::string name;
+        for (int64_t id = 1; id <= row_count; id++) {
+            name = "track-" + std::to_string(id) + ".flac";
+            stmt.bind(1, id, std::string_view(name));
+            stmt.exec();
+            sqlite3_reset(stmt.stmt);
+        }
+    }
+    db.exec("commit");
+
+    measure("legacy", db, [](SQLite &db, uint64_t &sum) {
+        auto stmt = db.prepare(query);
+        while (auto row = stmt.step())
+            legacy_call(*row, 0, [&](int64_t id, std::optional<std::string_view> name) {
+                sum += id + name->size();
+            });
+    });
+
+    measure("iterate", db, [](SQLite &db, uint64_t &sum) {
+        db.prepare(query).iterate([&](int64_t id, std::string_view name) {
+            sum += id + name.size();
+        });
+    });
+
+    measure("rows", db, [](SQLite &db, uint64_t &sum) {
+        for (auto [id, name] : db.prepare(query).rows<int64_t, std::string_view>())
+            sum += id + name.size();
+    });
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "cache.hxx"
+#include "stats.hxx"
+
+namespace {
+
+struct Counters {
+    Stats::Metric hits;
+    Stats::Metric misses;
+};
+
+}
+
+static const Counters attr_counters = {
+    Stats::counter("cache.attr.hits"), Stats::counter("cache.attr.misses")};
+static const Counters tag_counters = {
+    Stats::counter("cache.tag.hits"), Stats::counter("cache.tag.misses")};
+static const Counters file_counters = {
+    Stats::counter("cache.file.hits"), Stats::counter("cache.file.misses")};
+static const Counters plan_counters = {
+    Stats::counter("cache.plan.hits"), Stats::counter("cache.plan.misses")};
+
+static auto count(const Counters &counters, bool hit) noexcept -> bool {
+    Stats::add(hit ? counters.hits : counters.misses);
+    return hit;
+}
+
+Cache::Cache(
+    std::size_t max_files,
+    std::size_t max_names,
+    std::size_t max_plans
+)
+    : attrs(max_files)
+    , names(max_names)
+    , plans(max_plans)
+{}
+
+auto Cache::generation() const noexcept -> uint64_t {
+    return gen.load(std::memory_order_acquire);
+}
+
+auto Cache::attr(int64_t file, struct stat *sb) -> bool {
+    std::lock_guard lock(mutex);
+    auto attr = attrs.find(file);
+    if (!count(attr_counters, attr != nullptr))
+        return false;
+    *sb = *attr;
+    return true;
+}
+
+auto Cache::put_attr(uint64_t gen, int64_t file, const struct stat &sb) -> void {
+    std::lock_guard lock(mutex);
+    if (gen == generation())
+        attrs.get(file) = sb;
+}
+
+auto Cache::forget_attr(int64_t file) -> void {
+    std::lock_guard lock(mutex);
+    gen.fetch_add(1, std::memory_order_release);
+    attrs.erase(file);
+}
+
+auto Cache::tag(std::string_view name) -> std::optional<Resolved> {
+    std::lock_guard lock(mutex);
+    auto entry = names.find(std::string(name));
+    if (!count(tag_counters, entry && entry->tag))
+        return {};
+    return entry->tag;
+}
+
+auto Cache::put_tag(uint64_t gen, std::string_view name, Resolved tag) -> void {
+    std::lock_guard lock(mutex);
+    if (gen == generation())
+        names.get(std::string(name)).tag = tag;
+}
+
+auto Cache::file(
+    std::string_view name,
+    const std::vector<int64_t> &tags
+) -> std::optional<Resolved> {
+    std::lock_guard lock(mutex);
+    if (auto entry = names.find(std::string(name))) {
+        if (auto it = entry->files.find(tags); it != entry->files.end()) {
+            count(file_counters, true);
+            return it->second;
+        }
+    }
+    count(file_counters, false);
+    return {};
+}
+
+auto Cache::put_file(
+    uint64_t gen,
+    std::string_view name,
+    const std::vector<int64_t> &tags,
+    Resolved file
+) -> void {
+    std::lock_guard lock(mutex);
+    if (gen == generation())
+        names.get(std::string(name)).files[tags] = file;
+}
+
+auto Cache::forget_name(std::string_view name) -> void {
+    std::lock_guard lock(mutex);
+    gen.fetch_add(1, std::memory_order_release);
+    names.erase(std::string(name));
+}
+
+auto Cache::plan(const std::string &query) -> Plan {
+    std::lock_guard lock(mutex);
+    auto plan = plans.find(query);
+    if (!count(plan_counters, plan != nullptr))
+        return {};
+    return *plan;
+}
+
+auto Cache::put_plan(uint64_t gen, const std::string &query, Plan plan) -> void {
+    std::lock_guard lock(mutex);
+    if (gen == generation())
+        plans.get(query) = std::move(plan);
+}
+
+auto Cache::forget_plans() -> void {
+    std::lock_guard lock(mutex);
+    gen.fetch_add(1, std::memory_order_release);
+    plans.clear();
+}
+
+auto Cache::clear() -> void {
+    std::lock_guard lock(mutex);
+    gen.fetch_add(1, std::memory_order_release);
+    attrs.clear();
+    names.clear();
+    plans.clear();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "query.hxx"
+
+/* Least recently used map holding at most `capacity` entries. */
+template<typename K, typename V, typename Hash = std::hash<K>>
+class Lru {
+    using Entry = std::pair<K, V>;
+
+    std::size_t capacity;
+    std::list<Entry> entries;
+    std::unordered_map<K, typename std::list<Entry>::iterator, Hash> map;
+
+public:
+    Lru(std::size_t capacity) : capacity(capacity) {}
+
+    auto find(const K &key) -> V * {
+        auto it = map.find(key);
+        if (it == map.end())
+            return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    auto get(const K &key) -> V & {
+        if (auto v = find(key))
+            return *v;
+        entries.emplace_front(key, V());
+        map.emplace(key, entries.begin());
+        if (map.size() > capacity) {
+            map.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return entries.front().second;
+    }
+
+    auto erase(const K &key) -> void {
+        auto it = map.find(key);
+        if (it == map.end())
+            return;
+        entries.erase(it->second);
+        map.erase(it);
+    }
+
+    auto clear() -> void {
+        entries.clear();
+        map.clear();
+    }
+};
+
+/*
+ * What `TagFS` learned from the database: file attributes, what a name
+ * resolves to (a tag, or a file in a given tag set, or nothing), and
+ * parsed queries. Entries are dropped as soon as the rows they were read
+ * from change.
+ *
+ * A value computed from the database is only stored if nothing was
+ * invalidated since `generation()` was read before computing it, so a
+ * lookup racing with a write can never cache what the write just undid.
+ */
+class Cache {
+public:
+    /* a file id, or no file, known to be what a name resolves to */
+    using Resolved = std::optional<int64_t>;
+
+    using Plan = std::shared_ptr<const Query::Plan>;
+
+private:
+    struct Name {
+        std::optional<Resolved> tag;
+        std::map<std::vector<int64_t>, Resolved> files;
+    };
+
+    std::atomic<uint64_t> gen = 0;
+
+    std::mutex mutex;
+    Lru<int64_t, struct stat> attrs;
+    Lru<std::string, Name> names;
+    /* by query text */
+    Lru<std::string, Plan> plans;
+
+public:
+    Cache(std::size_t max_files, std::size_t max_names, std::size_t max_plans);
+
+    auto generation() const noexcept -> uint64_t;
+
+    auto attr(int64_t file, struct stat *) -> bool;
+    auto put_attr(uint64_t gen, int64_t file, const struct stat &) -> void;
+    auto forget_attr(int64_t file) -> void;
+
+    auto tag(std::string_view name) -> std::optional<Resolved>;
+    auto put_tag(uint64_t gen, std::string_view name, Resolved tag) -> void;
+    auto file(std::string_view name, const std::vector<int64_t> &tags) -> std::optional<Resolved>;
+    auto put_file(uint64_t gen, std::string_view name, const std::vector<int64_t> &tags, Resolved file) -> void;
+    /* anything named `name`, tag or file, may have appeared or disappeared */
+    auto forget_name(std::string_view name) -> void;
+
+    auto plan(const std::string &query) -> Plan;
+    auto put_plan(uint64_t gen, const std::string &query, Plan) -> void;
+    /* plans hold tag ids looked up by name: drop them when any name changes */
+    auto forget_plans() -> void;
+
+    /* the database changed in ways nobody kept track of */
+    auto clear() -> void;
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #define FUSE_USE_VERSION 35
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -0,0 +1,735 @@
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fuse_lowlevel.hxx"
+#include "stats.hxx"
+
+auto FuseLowlevel::entry_param(struct fuse_entry_param *e) const noexcept -> void {
+    *e = {};
+    e->entry_timeout = entry_timeout;
+    e->attr_timeout = attr_timeout;
+}
+
+auto FuseLowlevel::init([[maybe_unused]] struct fuse_conn_info *conn) -> void {}
+
+auto FuseLowlevel::lookup(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t parent,
+    [[maybe_unused]] const char *name,
+    [[maybe_unused]] struct fuse_entry_param *e
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::forget(
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] uint64_t nlookup
+) -> void {}
+
+auto FuseLowlevel::getattr(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct stat *sb,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::setattr(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct stat *attr,
+    [[maybe_unused]] int to_set,
+    [[maybe_unused]] struct stat *out,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::mkdir(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t parent,
+    [[maybe_unused]] const char *name,
+    [[maybe_unused]] mode_t mode,
+    [[maybe_unused]] struct fuse_entry_param *e
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::unlink(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t parent,
+    [[maybe_unused]] const char *name
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::rmdir(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t parent,
+    [[maybe_unused]] const char *name
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::rename(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t parent,
+    [[maybe_unused]] const char *name,
+    [[maybe_unused]] fuse_ino_t newparent,
+    [[maybe_unused]] const char *newname,
+    [[maybe_unused]] unsigned int flags
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::link(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] fuse_ino_t newparent,
+    [[maybe_unused]] const char *newname,
+    [[maybe_unused]] struct fuse_entry_param *e
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::open(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::read(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] size_t size,
+    [[maybe_unused]] off_t off,
+    [[maybe_unused]] struct fuse_file_info *fi,
+    [[maybe_unused]] struct fuse_bufvec *buf
+) -> int {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::write_buf(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_bufvec *buf,
+    [[maybe_unused]] off_t off,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> ssize_t {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::flush(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return 0;
+}
+
+auto FuseLowlevel::release(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return 0;
+}
+
+auto FuseLowlevel::fsync(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] int datasync,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return 0;
+}
+
+auto FuseLowlevel::opendir(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return 0;
+}
+
+auto FuseLowlevel::readdir(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] char *buf,
+    [[maybe_unused]] size_t size,
+    [[maybe_unused]] off_t off,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> ssize_t {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::releasedir(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return 0;
+}
+
+auto FuseLowlevel::readdirplus(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] char *buf,
+    [[maybe_unused]] size_t size,
+    [[maybe_unused]] off_t off,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> ssize_t {
+    return -ENOSYS;
+}
+
+auto FuseLowlevel::create(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t parent,
+    [[maybe_unused]] const char *name,
+    [[maybe_unused]] mode_t mode,
+    [[maybe_unused]] struct fuse_entry_param *e,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    return -ENOSYS;
+}
+
+/* how long each operation takes, reply included */
+static const struct {
+    Stats::Metric lookup = Stats::histogram("fuse.lookup");
+    Stats::Metric forget = Stats::histogram("fuse.forget");
+    Stats::Metric forget_multi = Stats::histogram("fuse.forget_multi");
+    Stats::Metric getattr = Stats::histogram("fuse.getattr");
+    Stats::Metric setattr = Stats::histogram("fuse.setattr");
+    Stats::Metric mkdir = Stats::histogram("fuse.mkdir");
+    Stats::Metric unlink = Stats::histogram("fuse.unlink");
+    Stats::Metric rmdir = Stats::histogram("fuse.rmdir");
+    Stats::Metric rename = Stats::histogram("fuse.rename");
+    Stats::Metric link = Stats::histogram("fuse.link");
+    Stats::Metric open = Stats::histogram("fuse.open");
+    Stats::Metric read = Stats::histogram("fuse.read");
+    Stats::Metric write_buf = Stats::histogram("fuse.write_buf");
+    Stats::Metric flush = Stats::histogram("fuse.flush");
+    Stats::Metric release = Stats::histogram("fuse.release");
+    Stats::Metric fsync = Stats::histogram("fuse.fsync");
+    Stats::Metric opendir = Stats::histogram("fuse.opendir");
+    Stats::Metric readdir = Stats::histogram("fuse.readdir");
+    Stats::Metric releasedir = Stats::histogram("fuse.releasedir");
+    Stats::Metric readdirplus = Stats::histogram("fuse.readdirplus");
+    Stats::Metric create = Stats::histogram("fuse.create");
+} op_metrics;
+
+static auto userdata(fuse_req_t req) noexcept -> FuseLowlevel * {
+    return static_cast<FuseLowlevel *>(fuse_req_userdata(req));
+}
+
+static auto reply_entry(
+    fuse_req_t req,
+    int res,
+    const struct fuse_entry_param *e
+) noexcept -> void {
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, e);
+}
+
+static auto reply_status(fuse_req_t req, int res) noexcept -> void {
+    fuse_reply_err(req, res < 0 ? -res : 0);
+}
+
+static auto do_init(void *data, struct fuse_conn_info *conn) noexcept -> void try {
+    static_cast<FuseLowlevel *>(data)->init(conn);
+} catch (...) {}
+
+static auto do_lookup(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.lookup);
+    auto fuse = userdata(req);
+    struct fuse_entry_param e;
+    fuse->entry_param(&e);
+    int res = fuse->lookup(req, parent, name, &e);
+    if (res == -ENOENT && fuse->negative_timeout > 0) {
+        fuse->entry_param(&e);
+        e.entry_timeout = fuse->negative_timeout;
+        res = 0;
+    }
+    reply_entry(req, res, &e);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_forget(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    uint64_t nlookup
+) noexcept -> void {
+    Stats::Timer timer(op_metrics.forget);
+    try {
+        userdata(req)->forget(ino, nlookup);
+    } catch (...) {}
+    fuse_reply_none(req);
+}
+
+static auto do_forget_multi(
+    fuse_req_t req,
+    size_t count,
+    struct fuse_forget_data *forgets
+) noexcept -> void {
+    Stats::Timer timer(op_metrics.forget_multi);
+    auto fuse = userdata(req);
+    for (size_t i = 0; i < count; i++) {
+        try {
+            fuse->forget(forgets[i].ino, forgets[i].nlookup);
+        } catch (...) {}
+    }
+    fuse_reply_none(req);
+}
+
+static auto do_getattr(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.getattr);
+    auto fuse = userdata(req);
+    struct stat sb{};
+    int res = fuse->getattr(req, ino, &sb, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, &sb, fuse->attr_timeout);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_setattr(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct stat *attr,
+    int to_set,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.setattr);
+    auto fuse = userdata(req);
+    struct stat out{};
+    int res = fuse->setattr(req, ino, attr, to_set, &out, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, &out, fuse->attr_timeout);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_mkdir(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    mode_t mode
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.mkdir);
+    auto fuse = userdata(req);
+    struct fuse_entry_param e;
+    fuse->entry_param(&e);
+    reply_entry(req, fuse->mkdir(req, parent, name, mode, &e), &e);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_unlink(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.unlink);
+    reply_status(req, userdata(req)->unlink(req, parent, name));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_rmdir(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.rmdir);
+    reply_status(req, userdata(req)->rmdir(req, parent, name));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_rename(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    fuse_ino_t newparent,
+    const char *newname,
+    unsigned int flags
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.rename);
+    reply_status(req, userdata(req)->rename(req, parent, name, newparent, newname, flags));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_link(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    fuse_ino_t newparent,
+    const char *newname
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.link);
+    auto fuse = userdata(req);
+    struct fuse_entry_param e;
+    fuse->entry_param(&e);
+    reply_entry(req, fuse->link(req, ino, newparent, newname, &e), &e);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_open(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.open);
+    int res = userdata(req)->open(req, ino, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_open(req, fi);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_read(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.read);
+    struct fuse_bufvec buf{};
+    buf.count = 1;
+    buf.buf[0].size = size;
+    buf.buf[0].fd = -1;
+
+    int res = userdata(req)->read(req, ino, size, off, fi, &buf);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_write_buf(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_bufvec *buf,
+    off_t off,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.write_buf);
+    auto res = userdata(req)->write_buf(req, ino, buf, off, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_flush(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.flush);
+    reply_status(req, userdata(req)->flush(req, ino, fi));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_release(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.release);
+    reply_status(req, userdata(req)->release(req, ino, fi));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_fsync(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    int datasync,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.fsync);
+    reply_status(req, userdata(req)->fsync(req, ino, datasync, fi));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_opendir(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.opendir);
+    int res = userdata(req)->opendir(req, ino, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_open(req, fi);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_readdir(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.readdir);
+    auto buf = std::make_unique<char[]>(size);
+    auto res = userdata(req)->readdir(req, ino, buf.get(), size, off, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf.get(), res);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_releasedir(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.releasedir);
+    reply_status(req, userdata(req)->releasedir(req, ino, fi));
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_readdirplus(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.readdirplus);
+    auto buf = std::make_unique<char[]>(size);
+    auto res = userdata(req)->readdirplus(req, ino, buf.get(), size, off, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf.get(), res);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+static auto do_create(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    mode_t mode,
+    struct fuse_file_info *fi
+) noexcept -> void try {
+    Stats::Timer timer(op_metrics.create);
+    auto fuse = userdata(req);
+    struct fuse_entry_param e;
+    fuse->entry_param(&e);
+    int res = fuse->create(req, parent, name, mode, &e, fi);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_create(req, &e, fi);
+} catch (...) {
+    fuse_reply_err(req, EIO);
+}
+
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+FuseLowlevel::FuseLowlevel(int argc, char **argv)
+    : args(argc, argv)
+    , op{
+        .init = do_init,
+        .lookup = do_lookup,
+        .forget = do_forget,
+        .getattr = do_getattr,
+        .setattr = do_setattr,
+        .mkdir = do_mkdir,
+        .unlink = do_unlink,
+        .rmdir = do_rmdir,
+        .rename = do_rename,
+        .link = do_link,
+        .open = do_open,
+        .read = do_read,
+        .flush = do_flush,
+        .release = do_release,
+        .fsync = do_fsync,
+        .opendir = do_opendir,
+        .readdir = do_readdir,
+        .releasedir = do_releasedir,
+        .create = do_create,
+        .write_buf = do_write_buf,
+        .forget_multi = do_forget_multi,
+        .readdirplus = do_readdirplus,
+    }
+{
+    args.parse_cmdline(&opts);
+    if (!opts.mountpoint)
+        throw std::runtime_error("no mountpoint specified");
+
+    se = fuse_session_new(&args.args, &op, sizeof op, this);
+    if (se == NULL)
+        throw std::runtime_error("failed to initialize fuse session");
+
+    if (fuse_set_signal_handlers(se) != 0)
+        throw std::runtime_error("failed to set signal handlers");
+
+    if (!opts.foreground)
+        detach();
+}
+
+FuseLowlevel::~FuseLowlevel() {
+    /* never mounted: the parent exits with an error */
+    if (daemon_fd >= 0)
+        close(daemon_fd);
+    fuse_remove_signal_handlers(se);
+    fuse_session_unmount(se);
+    fuse_session_destroy(se);
+    free(opts.mountpoint);
+}
+
+/*
+ * Fork before the subclass starts any thread, which would not survive it,
+ * or opens anything whose locks would not. The parent waits on a pipe for
+ * `run` to report the mount, and exits with its outcome.
+ */
+auto FuseLowlevel::detach() -> void {
+    int waiter[2];
+    if (pipe2(waiter, O_CLOEXEC) != 0)
+        throw std::system_error(errno, std::generic_category(), "failed to create pipe");
+
+    switch (fork()) {
+    case -1:
+        throw std::system_error(errno, std::generic_category(), "failed to fork");
+    case 0:
+        break;
+    default: {
+        close(waiter[1]);
+        char mounted = 0;
+        _exit(::read(waiter[0], &mounted, 1) == 1 && mounted ? 0 : 1);
+    }
+    }
+
+    close(waiter[0]);
+    daemon_fd = waiter[1];
+    if (setsid() == -1)
+        throw std::system_error(errno, std::generic_category(), "failed to start a session");
+}
+
+auto FuseLowlevel::run() -> int {
+    /* interrupted while the subclass was still getting ready */
+    if (fuse_session_exited(se))
+        return 0;
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        throw std::runtime_error("failed to mount fuse");
+
+    (void) chdir("/");
+    if (daemon_fd >= 0) {
+        int nullfd = ::open("/dev/null", O_RDWR);
+        if (nullfd >= 0) {
+            dup2(nullfd, STDIN_FILENO);
+            dup2(nullfd, STDOUT_FILENO);
+            dup2(nullfd, STDERR_FILENO);
+            if (nullfd > STDERR_FILENO)
+                close(nullfd);
+        }
+        char mounted = 1;
+        (void) ::write(daemon_fd, &mounted, 1);
+        close(daemon_fd);
+        daemon_fd = -1;
+    }
+
+    std::thread notifier(&FuseLowlevel::notify_loop, this);
+
+    int res;
+    if (opts.singlethread) {
+        res = fuse_session_loop(se);
+    } else {
+        struct fuse_loop_config loop_config{
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads,
+        };
+        res = fuse_session_loop_mt(se, &loop_config);
+    }
+
+    {
+        std::lock_guard lock(notify_mutex);
+        notify_stop = true;
+    }
+    notify_cond.notify_one();
+    notifier.join();
+
+    return res;
+}
+
+auto FuseLowlevel::invalidate_entry(fuse_ino_t parent, std::string name) -> void {
+    {
+        std::lock_guard lock(notify_mutex);
+        notifications.push_back({parent, std::move(name)});
+    }
+    notify_cond.notify_one();
+}
+
+auto FuseLowlevel::invalidate_inode(fuse_ino_t ino) -> void {
+    {
+        std::lock_guard lock(notify_mutex);
+        notifications.push_back({ino, {}});
+    }
+    notify_cond.notify_one();
+}
+
+/* failures are fine: the kernel may simply not have the entry cached */
+auto FuseLowlevel::notify_loop() -> void {
+    std::unique_lock lock(notify_mutex);
+    for (;;) {
+        notify_cond.wait(lock, [&] { return notify_stop || !notifications.empty(); });
+        if (notify_stop)
+            return;
+
+        auto n = std::move(notifications.front());
+        notifications.pop_front();
+        lock.unlock();
+
+        if (n.name.empty())
+            fuse_lowlevel_notify_inval_inode(se, n.ino, 0, 0);
+        else
+            fuse_lowlevel_notify_inval_entry(se, n.ino, n.name.data(), n.name.size());
+
+        lock.lock();
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/types.h>
+
+#include "fuse.hxx"
+
+/*
+ * Inode-based counterpart of `Fuse`, built on the low-level session API.
+ * Operations return 0 (or a byte count) on success and a negated errno on
+ * failure, like the high-level callbacks; the trampolines turn that into
+ * the matching `fuse_reply_*` call.
+ *
+ * The constructor goes to the background unless told to stay in the
+ * foreground, but nothing is mounted until `run`: a subclass can get
+ * ready in its own constructor, however long that takes, before any
+ * request can reach it.
+ */
+class FuseLowlevel {
+    Fuse::Args args;
+    struct fuse_lowlevel_ops op;
+    struct fuse_cmdline_opts opts;
+
+    /* an inode, or a name in it when `name` is not empty */
+    struct Notification {
+        fuse_ino_t ino;
+        std::string name;
+    };
+
+    std::mutex notify_mutex;
+    std::condition_variable notify_cond;
+    std::deque<Notification> notifications;
+    bool notify_stop = false;
+
+    /* where to report the mount to the parent waiting in `detach`, -1 if none */
+    int daemon_fd = -1;
+
+protected:
+    struct fuse_session *se;
+
+    /*
+     * Drop what the kernel cached about an entry or inode. Sent from a
+     * separate thread: the kernel may hold locks for the request being
+     * handled that the invalidation needs.
+     */
+    auto invalidate_entry(fuse_ino_t parent, std::string name) -> void;
+    auto invalidate_inode(fuse_ino_t) -> void;
+
+public:
+    /* how long the kernel may cache replies to `lookup`/`getattr` */
+    double entry_timeout = 0.0;
+    double attr_timeout = 0.0;
+    /* how long a failed `lookup` is remembered, 0 to not remember it */
+    double negative_timeout = 0.0;
+
+    FuseLowlevel(int argc, char **argv);
+    virtual ~FuseLowlevel();
+
+    FuseLowlevel(const FuseLowlevel &) = delete;
+    FuseLowlevel &operator=(const FuseLowlevel &) = delete;
+
+    /* mount, then serve requests until unmounted or interrupted */
+    auto run() -> int;
+
+    /* filled in by the trampolines before `lookup`, `mkdir`, `link` and `create` */
+    auto entry_param(struct fuse_entry_param *) const noexcept -> void;
+
+    virtual auto init(struct fuse_conn_info *) -> void;
+    virtual auto lookup(fuse_req_t, fuse_ino_t parent, const char *name, struct fuse_entry_param *) -> int;
+    virtual auto forget(fuse_ino_t, uint64_t nlookup) -> void;
+    virtual auto getattr(fuse_req_t, fuse_ino_t, struct stat *, struct fuse_file_info *) -> int;
+    /* `out` receives the attributes after the change */
+    virtual auto setattr(fuse_req_t, fuse_ino_t, struct stat *attr, int to_set, struct stat *out, struct fuse_file_info *) -> int;
+    virtual auto mkdir(fuse_req_t, fuse_ino_t parent, const char *name, mode_t, struct fuse_entry_param *) -> int;
+    virtual auto unlink(fuse_req_t, fuse_ino_t parent, const char *name) -> int;
+    virtual auto rmdir(fuse_req_t, fuse_ino_t parent, const char *name) -> int;
+    virtual auto rename(fuse_req_t, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) -> int;
+    virtual auto link(fuse_req_t, fuse_ino_t, fuse_ino_t newparent, const char *newname, struct fuse_entry_param *) -> int;
+    virtual auto open(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int;
+    /*
+     * `buf` comes in as a single empty buffer of `size` bytes; point it at
+     * memory or, to let the data be spliced, at a file descriptor.
+     */
+    virtual auto read(fuse_req_t, fuse_ino_t, size_t size, off_t off, struct fuse_file_info *, struct fuse_bufvec *buf) -> int;
+    virtual auto write_buf(fuse_req_t, fuse_ino_t, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *) -> ssize_t;
+    virtual auto flush(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int;
+    virtual auto release(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int;
+    virtual auto fsync(fuse_req_t, fuse_ino_t, int datasync, struct fuse_file_info *) -> int;
+    virtual auto opendir(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int;
+    virtual auto readdir(fuse_req_t, fuse_ino_t, char *buf, size_t size, off_t off, struct fuse_file_info *) -> ssize_t;
+    virtual auto releasedir(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int;
+    virtual auto readdirplus(fuse_req_t, fuse_ino_t, char *buf, size_t size, off_t off, struct fuse_file_info *) -> ssize_t;
+    virtual auto create(fuse_req_t, fuse_ino_t parent, const char *name, mode_t, struct fuse_entry_param *, struct fuse_file_info *) -> int;
+
+private:
+    auto detach() -> void;
+    auto notify_loop() -> void;
+};
@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "index.hxx"
+
+/*
+ * Intersection of two sorted arrays of distinct values into `out`, which
+ * must have room for the smaller one. Returns the number of values
+ * written.
+ */
+static auto intersect_arrays(
+    const uint16_t *a, std::size_t na,
+    const uint16_t *b, std::size_t nb,
+    uint16_t *out
+) noexcept -> std::size_t {
+    if (na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+
+    std::size_t i = 0, j = 0, k = 0;
+
+    /* very lopsided sizes: look each value of the small side up */
+    if (na * 32 < nb) {
+        for (; i < na; i++) {
+            auto it = std::lower_bound(b + j, b + nb, a[i]);
+            j = it - b;
+            if (j == nb)
+                break;
+            if (*it == a[i])
+                out[k++] = a[i];
+        }
+        return k;
+    }
+
+#if defined(__SSE2__)
+    /*
+     * Compare blocks of 8 values against all 8 rotations of the other
+     * block, then advance whichever block ends lower.
+     */
+    while (i + 8 <= na && j + 8 <= nb) {
+        auto va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j));
+
+        auto eq = _mm_cmpeq_epi16(va, vb);
+        for (int r = 1; r < 8; r++) {
+            vb = _mm_or_si128(_mm_srli_si128(vb, 2), _mm_slli_si128(vb, 14));
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi16(va, vb));
+        }
+
+        unsigned mask = _mm_movemask_epi8(eq);
+        for (int l = 0; l < 8; l++)
+            if (mask & (1u << (2 * l)))
+                out[k++] = a[i + l];
+
+        auto amax = a[i + 7], bmax = b[j + 7];
+        if (amax <= bmax)
+            i += 8;
+        if (bmax <= amax)
+            j += 8;
+    }
+#endif
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out[k++] = a[i];
+            i++;
+            j++;
+        }
+    }
+
+    return k;
+}
+
+static auto test_bit(const std::vector<uint64_t> &bitmap, uint16_t low) noexcept -> bool {
+    return bitmap[low / 64] >> (low % 64) & 1;
+}
+
+auto Postings::Chunk::contains(uint16_t low) const noexcept -> bool {
+    if (is_bitmap())
+        return test_bit(bitmap, low);
+    return std::binary_search(array.begin(), array.end(), low);
+}
+
+auto Postings::find(uint16_t key) const noexcept -> const Chunk * {
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), key,
+        [](const Chunk &c, uint16_t key) { return c.key < key; });
+    if (it == chunks.end() || it->key != key)
+        return nullptr;
+    return &*it;
+}
+
+auto Postings::insert(uint32_t id) -> bool {
+    uint16_t key = id >> 16, low = id & 0xffff;
+
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), key,
+        [](const Chunk &c, uint16_t key) { return c.key < key; });
+    if (it == chunks.end() || it->key != key)
+        it = chunks.insert(it, Chunk{key, 0, {}, {}});
+    auto &chunk = *it;
+
+    if (chunk.is_bitmap()) {
+        auto &word = chunk.bitmap[low / 64];
+        auto bit = uint64_t(1) << (low % 64);
+        if (word & bit)
+            return false;
+        word |= bit;
+    } else {
+        auto pos = std::lower_bound(chunk.array.begin(), chunk.array.end(), low);
+        if (pos != chunk.array.end() && *pos == low)
+            return false;
+        chunk.array.insert(pos, low);
+
+        if (chunk.array.size() > array_max) {
+            chunk.bitmap.assign(bitmap_words, 0);
+            for (auto v : chunk.array)
+                chunk.bitmap[v / 64] |= uint64_t(1) << (v % 64);
+            chunk.array = {};
+        }
+    }
+
+    chunk.cardinality++;
+    count++;
+    return true;
+}
+
+auto Postings::erase(uint32_t id) -> bool {
+    uint16_t key = id >> 16, low = id & 0xffff;
+
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), key,
+        [](const Chunk &c, uint16_t key) { return c.key < key; });
+    if (it == chunks.end() || it->key != key)
+        return false;
+    auto &chunk = *it;
+
+    if (chunk.is_bitmap()) {
+        auto &word = chunk.bitmap[low / 64];
+        auto bit = uint64_t(1) << (low % 64);
+        if (!(word & bit))
+            return false;
+        word &= ~bit;
+
+        if (chunk.cardinality - 1 <= array_max) {
+            for (std::size_t w = 0; w < bitmap_words; w++)
+                for (auto bits = chunk.bitmap[w]; bits; bits &= bits - 1)
+                    chunk.array.push_back(w * 64 + __builtin_ctzll(bits));
+            chunk.bitmap = {};
+        }
+    } else {
+        auto pos = std::lower_bound(chunk.array.begin(), chunk.array.end(), low);
+        if (pos == chunk.array.end() || *pos != low)
+            return false;
+        chunk.array.erase(pos);
+    }
+
+    count--;
+    if (--chunk.cardinality == 0)
+        chunks.erase(it);
+    return true;
+}
+
+auto Postings::contains(uint32_t id) const noexcept -> bool {
+    auto chunk = find(id >> 16);
+    return chunk && chunk->contains(id & 0xffff);
+}
+
+/*
+ * Chunks are intersected key by key, walking the rarest set and looking
+ * each key up in the others, rarest first, so the working set shrinks as
+ * early as possible. It stays a bitmap only while every operand so far
+ * was one.
+ */
+auto Postings::intersect(
+    std::vector<const Postings *> sets,
+    uint32_t after,
+    std::size_t limit
+) -> std::vector<int64_t> {
+    std::vector<int64_t> res;
+    if (sets.empty() || limit == 0)
+        return res;
+
+    std::sort(sets.begin(), sets.end(),
+        [](const Postings *a, const Postings *b) { return a->size() < b->size(); });
+
+    const auto &rarest = sets.front()->chunks;
+    auto first = std::lower_bound(rarest.begin(), rarest.end(), uint16_t(after >> 16),
+        [](const Chunk &c, uint16_t key) { return c.key < key; });
+
+    std::vector<uint16_t> array, scratch;
+    std::vector<uint64_t> bitmap;
+
+    for (auto chunk = first; chunk != rarest.end(); chunk++) {
+        bool is_bitmap = chunk->is_bitmap();
+        if (is_bitmap)
+            bitmap = chunk->bitmap;
+        else
+            array = chunk->array;
+
+        bool empty = false;
+        for (auto set = sets.begin() + 1; set != sets.end() && !empty; set++) {
+            auto other = (*set)->find(chunk->key);
+            if (!other) {
+                empty = true;
+                break;
+            }
+
+            if (!is_bitmap && !other->is_bitmap()) {
+                scratch.resize(array.size());
+                scratch.resize(intersect_arrays(
+                    array.data(), array.size(),
+                    other->array.data(), other->array.size(),
+                    scratch.data()));
+                std::swap(array, scratch);
+                empty = array.empty();
+            } else if (!is_bitmap) {
+                array.erase(std::remove_if(array.begin(), array.end(),
+                    [&](uint16_t v) { return !test_bit(other->bitmap, v); }),
+                    array.end());
+                empty = array.empty();
+            } else if (!other->is_bitmap()) {
+                array.clear();
+                for (auto v : other->array)
+                    if (test_bit(bitmap, v))
+                        array.push_back(v);
+                is_bitmap = false;
+                empty = array.empty();
+            } else {
+                uint64_t any = 0;
+                for (std::size_t w = 0; w < bitmap_words; w++)
+                    any |= bitmap[w] &= other->bitmap[w];
+                empty = !any;
+            }
+        }
+        if (empty)
+            continue;
+
+        auto emit = [&](uint16_t low) {
+            uint32_t id = uint32_t(chunk->key) << 16 | low;
+            if (id > after)
+                res.push_back(id);
+            return res.size() < limit;
+        };
+
+        if (is_bitmap) {
+            for (std::size_t w = 0; w < bitmap_words; w++)
+                for (auto bits = bitmap[w]; bits; bits &= bits - 1)
+                    if (!emit(w * 64 + __builtin_ctzll(bits)))
+                        return res;
+        } else {
+            for (auto v : array)
+                if (!emit(v))
+                    return res;
+        }
+    }
+
+    return res;
+}
+
+/* file ids are rowids, which the `files_id_range` trigger keeps within 32 bits */
+static auto narrow(int64_t file) -> uint32_t {
+    if (file < 0 || file > std::numeric_limits<uint32_t>::max())
+        throw std::out_of_range("file id out of the index range");
+    return static_cast<uint32_t>(file);
+}
+
+TagIndex::TagIndex() = default;
+
+TagIndex::~TagIndex() = default;
+
+auto TagIndex::load(SQLite &db) -> void {
+    std::unique_lock lock(mutex);
+    tags.clear();
+    for (auto [tag, file] : db.prepare("select tag_id, file_id from files_tags order by tag_id, file_id")
+                                .rows<int64_t, int64_t>())
+        tags[tag].insert(narrow(file));
+}
+
+auto TagIndex::add(int64_t file, int64_t tag) -> void {
+    std::unique_lock lock(mutex);
+    tags[tag].insert(narrow(file));
+}
+
+auto TagIndex::add(int64_t file, const std::vector<int64_t> &tags) -> void {
+    std::unique_lock lock(mutex);
+    for (auto tag : tags)
+        this->tags[tag].insert(narrow(file));
+}
+
+auto TagIndex::remove(int64_t file, int64_t tag) -> void {
+    std::unique_lock lock(mutex);
+    auto it = tags.find(tag);
+    if (it == tags.end())
+        return;
+    it->second.erase(narrow(file));
+    if (it->second.size() == 0)
+        tags.erase(it);
+}
+
+auto TagIndex::remove(int64_t file, const std::vector<int64_t> &tags) -> void {
+    std::unique_lock lock(mutex);
+    for (auto tag : tags) {
+        auto it = this->tags.find(tag);
+        if (it == this->tags.end())
+            continue;
+        it->second.erase(narrow(file));
+        if (it->second.size() == 0)
+            this->tags.erase(it);
+    }
+}
+
+auto TagIndex::remove_tag(int64_t tag) -> void {
+    std::unique_lock lock(mutex);
+    tags.erase(tag);
+}
+
+auto TagIndex::cardinality(int64_t tag) const -> uint64_t {
+    std::shared_lock lock(mutex);
+    auto it = tags.find(tag);
+    return it == tags.end() ? 0 : it->second.size();
+}
+
+auto TagIndex::contains(int64_t file, const std::vector<int64_t> &tags) const -> bool {
+    std::shared_lock lock(mutex);
+    auto id = narrow(file);
+    return std::all_of(tags.begin(), tags.end(), [&](int64_t tag) {
+        auto it = this->tags.find(tag);
+        return it != this->tags.end() && it->second.contains(id);
+    });
+}
+
+auto TagIndex::carries_any(int64_t file, const std::vector<int64_t> &tags) const -> bool {
+    std::shared_lock lock(mutex);
+    auto id = narrow(file);
+    return std::any_of(tags.begin(), tags.end(), [&](int64_t tag) {
+        auto it = this->tags.find(tag);
+        return it != this->tags.end() && it->second.contains(id);
+    });
+}
+
+auto TagIndex::exclude(std::vector<int64_t> &files, const std::vector<int64_t> &tags) const -> void {
+    std::shared_lock lock(mutex);
+    std::vector<const Postings *> sets;
+    for (auto tag : tags)
+        if (auto it = this->tags.find(tag); it != this->tags.end())
+            sets.push_back(&it->second);
+    if (sets.empty())
+        return;
+
+    files.erase(std::remove_if(files.begin(), files.end(), [&](int64_t file) {
+        auto id = narrow(file);
+        return std::any_of(sets.begin(), sets.end(),
+            [&](const Postings *set) { return set->contains(id); });
+    }), files.end());
+}
+
+auto TagIndex::intersect(
+    const std::vector<int64_t> &tags,
+    int64_t after,
+    std::size_t limit
+) const -> std::vector<int64_t> {
+    if (after >= std::numeric_limits<uint32_t>::max())
+        return {};
+
+    std::shared_lock lock(mutex);
+    std::vector<const Postings *> sets;
+    for (auto tag : tags) {
+        auto it = this->tags.find(tag);
+        if (it == this->tags.end())
+            return {};
+        sets.push_back(&it->second);
+    }
+
+    return Postings::intersect(std::move(sets), std::max<int64_t>(after, 0), limit);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "sqlite.hxx"
+
+/*
+ * A set of 32-bit ids split into chunks of 2^16 by their high half. The
+ * low halves of a chunk are kept as a sorted array while it is sparse
+ * and as a 2^16-bit bitmap once it holds more than `array_max` ids.
+ */
+class Postings {
+public:
+    static constexpr std::size_t array_max = 4096;
+    static constexpr std::size_t bitmap_words = 65536 / 64;
+
+    struct Chunk {
+        uint16_t key;
+        uint32_t cardinality;
+        std::vector<uint16_t> array;
+        std::vector<uint64_t> bitmap;
+
+        auto is_bitmap() const noexcept -> bool { return !bitmap.empty(); }
+        auto contains(uint16_t) const noexcept -> bool;
+    };
+
+private:
+    std::vector<Chunk> chunks;
+    uint64_t count = 0;
+
+public:
+    auto insert(uint32_t) -> bool;
+    auto erase(uint32_t) -> bool;
+    auto contains(uint32_t) const noexcept -> bool;
+    auto size() const noexcept -> uint64_t { return count; }
+    auto find(uint16_t key) const noexcept -> const Chunk *;
+
+    /* see `TagIndex::intersect` */
+    static auto intersect(
+        std::vector<const Postings *> sets,
+        uint32_t after,
+        std::size_t limit
+    ) -> std::vector<int64_t>;
+};
+
+/*
+ * In-memory copy of `files_tags`: for each tag, the sorted set of files
+ * carrying it. Listing a tag directory intersects these sets instead of
+ * joining `files_tags` once per tag.
+ */
+class TagIndex {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<int64_t, Postings> tags;
+
+public:
+    TagIndex();
+    ~TagIndex();
+
+    auto load(SQLite &) -> void;
+
+    auto add(int64_t file, int64_t tag) -> void;
+    auto add(int64_t file, const std::vector<int64_t> &tags) -> void;
+    auto remove(int64_t file, int64_t tag) -> void;
+    auto remove(int64_t file, const std::vector<int64_t> &tags) -> void;
+    auto remove_tag(int64_t tag) -> void;
+
+    auto cardinality(int64_t tag) const -> uint64_t;
+    /* whether `file` carries every one of `tags` */
+    auto contains(int64_t file, const std::vector<int64_t> &tags) const -> bool;
+    /* whether `file` carries any of `tags` */
+    auto carries_any(int64_t file, const std::vector<int64_t> &tags) const -> bool;
+    /* drop from `files` those carrying any of `tags`, which are tried in order */
+    auto exclude(std::vector<int64_t> &files, const std::vector<int64_t> &tags) const -> void;
+    /*
+     * The files carrying every one of `tags`, in increasing order,
+     * starting after `after` and stopping at `limit` results.
+     */
+    auto intersect(
+        const std::vector<int64_t> &tags,
+        int64_t after = 0,
+        std::size_t limit = std::numeric_limits<std::size_t>::max()
+    ) const -> std::vector<int64_t>;
+};
@@ -31,7 +31,8 @@ static void tagfs_usage(struct fuse_args *args) {
            "\n"
            "FUSE options:\n",
            args->argv[0]);
-    fuse_lib_help(args);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
 }
 
 static int tagfs_opt_proc(
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <iterator>
+
+#include "query.hxx"
+
+auto Query::parse(std::string_view expr) -> std::optional<Query> {
+    Query query;
+    query.terms.emplace_back();
+
+    std::string name;
+    char op = '+';
+    bool named = false;
+    /* nothing read yet in this term */
+    bool leading = true;
+
+    auto flush = [&]() -> bool {
+        if (!named)
+            return false;
+        auto &term = query.terms.back();
+        (op == '-' ? term.none : term.all).push_back(std::move(name));
+        name.clear();
+        named = false;
+        return true;
+    };
+
+    for (std::size_t i = 0; i < expr.size(); i++) {
+        char c = expr[i];
+        switch (c) {
+        case '\\':
+            if (++i == expr.size())
+                return {};
+            name += expr[i];
+            named = true;
+            leading = false;
+            break;
+
+        case '+':
+        case '-':
+            /* only a term may start with an operator, and only with `-` */
+            if (!flush() && (c == '+' || !leading))
+                return {};
+            op = c;
+            leading = false;
+            break;
+
+        case ',':
+            if (!flush())
+                return {};
+            query.terms.emplace_back();
+            op = '+';
+            leading = true;
+            break;
+
+        default:
+            name += c;
+            named = true;
+            leading = false;
+        }
+    }
+
+    if (!flush())
+        return {};
+    return query;
+}
+
+static auto sorted(std::vector<int64_t> tags) -> std::vector<int64_t> {
+    std::sort(tags.begin(), tags.end());
+    tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+    return tags;
+}
+
+auto Query::plan(
+    const std::function<std::optional<int64_t>(std::string_view)> &tag_id
+) const -> Plan {
+    Plan plan;
+
+    for (auto &term : terms) {
+        Plan::Conjunction conj;
+        bool empty = false;
+
+        for (auto &name : term.all) {
+            if (auto tag = tag_id(name)) {
+                conj.all.push_back(*tag);
+            } else {
+                empty = true;
+                break;
+            }
+        }
+        /* excluding a tag nobody has excludes nothing */
+        for (auto &name : term.none)
+            if (auto tag = tag_id(name))
+                conj.none.push_back(*tag);
+
+        conj.all = sorted(std::move(conj.all));
+        conj.none = sorted(std::move(conj.none));
+        std::vector<int64_t> both;
+        std::set_intersection(conj.all.begin(), conj.all.end(),
+                              conj.none.begin(), conj.none.end(),
+                              std::back_inserter(both));
+        if (!empty && both.empty())
+            plan.any.push_back(std::move(conj));
+    }
+
+    return plan;
+}
+
+auto Query::run(
+    const Plan &plan,
+    const TagIndex &index,
+    const std::function<std::vector<int64_t>(int64_t after, std::size_t limit)> &everything,
+    int64_t after,
+    std::size_t limit
+) -> std::vector<int64_t> {
+    struct Step {
+        const Plan::Conjunction *conj;
+        uint64_t estimate;
+    };
+
+    std::vector<Step> steps;
+    for (auto &conj : plan.any) {
+        /* one without a positive tag reads every file, so it goes last */
+        uint64_t estimate = UINT64_MAX;
+        for (auto tag : conj.all)
+            estimate = std::min(estimate, index.cardinality(tag));
+        if (estimate)
+            steps.push_back({&conj, estimate});
+    }
+
+    /* smallest alternatives first, so the union grows from the cheap end */
+    std::sort(steps.begin(), steps.end(),
+        [](const Step &a, const Step &b) { return a.estimate < b.estimate; });
+
+    /*
+     * The first `limit` matches after `after` are among the first `limit`
+     * of each alternative, so no alternative is read further than that;
+     * one whose exclusions thin a chunk out reads on until it has enough.
+     */
+    std::vector<int64_t> res, files, chunk, merged;
+    for (auto &step : steps) {
+        auto none = step.conj->none;
+        std::sort(none.begin(), none.end(), [&](int64_t a, int64_t b) {
+            return index.cardinality(a) > index.cardinality(b);
+        });
+
+        files.clear();
+        for (int64_t from = after; files.size() < limit;) {
+            chunk = step.conj->all.empty() ? everything(from, limit)
+                                           : index.intersect(step.conj->all, from, limit);
+            if (chunk.empty())
+                break;
+            from = chunk.back();
+            bool last = chunk.size() < limit;
+
+            index.exclude(chunk, none);
+            files.insert(files.end(), chunk.begin(), chunk.end());
+            if (last)
+                break;
+        }
+
+        merged.clear();
+        std::set_union(res.begin(), res.end(), files.begin(), files.end(),
+                       std::back_inserter(merged));
+        std::swap(res, merged);
+        if (res.size() > limit)
+            res.resize(limit);
+    }
+
+    return res;
+}
+
+auto Query::matches(const Plan &plan, const TagIndex &index, int64_t file) -> bool {
+    return std::any_of(plan.any.begin(), plan.any.end(), [&](const Plan::Conjunction &conj) {
+        return index.contains(file, conj.all) && !index.carries_any(file, conj.none);
+    });
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "index.hxx"
+
+/*
+ * A tag query as written in a path under `/q`: tags joined by `+` (and)
+ * and `-` (and not), in alternatives separated by `,` (or), so it is
+ * already in disjunctive normal form. `jazz+flac-live,blues` selects
+ * files tagged jazz and flac but not live, plus those tagged blues. A
+ * leading `-` starts from every file; `\` takes the next character
+ * literally.
+ */
+class Query {
+public:
+    struct Term {
+        std::vector<std::string> all;
+        std::vector<std::string> none;
+    };
+
+    /* with tag names resolved to ids; alternatives that cannot match are gone */
+    struct Plan {
+        struct Conjunction {
+            std::vector<int64_t> all;
+            std::vector<int64_t> none;
+        };
+
+        std::vector<Conjunction> any;
+    };
+
+    std::vector<Term> terms;
+
+    static auto parse(std::string_view) -> std::optional<Query>;
+
+    auto plan(const std::function<std::optional<int64_t>(std::string_view)> &tag_id) const -> Plan;
+
+    /*
+     * The matching files after `after`, in increasing order, at most
+     * `limit` of them. Each alternative starts from its rarest tag, as
+     * counted by `index` right now, and subtracts the most common excluded
+     * tags first; `everything` lists every file after a given one, and is
+     * only called for alternatives without a positive tag.
+     */
+    static auto run(
+        const Plan &,
+        const TagIndex &index,
+        const std::function<std::vector<int64_t>(int64_t after, std::size_t limit)> &everything,
+        int64_t after = 0,
+        std::size_t limit = std::numeric_limits<std::size_t>::max()
+    ) -> std::vector<int64_t>;
+
+    static auto matches(const Plan &, const TagIndex &index, int64_t file) -> bool;
+};
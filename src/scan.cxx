@@ -0,0 +1,537 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scan.hxx"
+#include "sqlite.hxx"
+
+/* statements the import runs per transaction, roughly */
+static constexpr std::size_t batch_rows = 65536;
+
+/* how long a MOVED_FROM left at the end of a read waits for its MOVED_TO */
+static constexpr int move_wait_ms = 100;
+
+static constexpr uint32_t watch_mask =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB
+    | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+namespace {
+
+/* what a scan found in one directory that changed since the last one */
+struct Listing {
+    std::string dir;
+    /* 0 when too recent to be trusted next time */
+    int64_t mtime;
+    std::vector<std::string> files;
+    /* subdirectories recorded last time which are gone now */
+    std::vector<std::string> gone;
+};
+
+}
+
+static auto join(const std::string &dir, std::string_view name) -> std::string {
+    if (dir.empty())
+        return std::string(name);
+    std::string path;
+    path.reserve(dir.size() + 1 + name.size());
+    path.append(dir).append("/").append(name);
+    return path;
+}
+
+static auto parent_of(const std::string &path) -> std::string {
+    auto slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash);
+}
+
+/* the database and its journals live in the data directory too */
+static auto is_db_file(const std::string &dir, std::string_view name) -> bool {
+    return dir.empty() && name.substr(0, 11) == ".yatagfs.db";
+}
+
+static auto nanoseconds(const struct timespec &ts) -> int64_t {
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* split the entries of `dir`, open as `fd`, which this closes */
+static auto list(
+    int fd,
+    const std::string &dir,
+    std::vector<std::string> &files,
+    std::vector<std::string> &subdirs
+) -> bool {
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return false;
+    }
+
+    while (auto ent = readdir(d)) {
+        std::string_view name = ent->d_name;
+        if (name == "." || name == ".." || is_db_file(dir, name))
+            continue;
+
+        auto type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat sb;
+            if (fstatat(fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR)
+            subdirs.push_back(join(dir, name));
+        else if (type == DT_REG)
+            files.emplace_back(name);
+    }
+
+    closedir(d);
+    return true;
+}
+
+static auto open_dir(int datadirfd, const std::string &dir) -> int {
+    return openat(datadirfd, dir.empty() ? "." : dir.c_str(),
+                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* bring the rows of one directory in line with `listing` */
+static auto store(SQLite &conn, const Listing &listing, Scanner::Stats &stats) -> std::size_t {
+    const auto &dir = listing.dir;
+    std::unordered_set<std::string_view> listed(listing.files.begin(), listing.files.end());
+    std::unordered_set<std::string> present;
+    std::vector<int64_t> stale;
+
+    {
+        /* the direct children only, through the `files_dir` index */
+        auto stmt = conn.prepare_bind(
+            "select id, name from files where rtrim(path, replace(path, '/', '')) = ?",
+            dir.empty() ? dir : dir + "/");
+        for (auto [id, name] : stmt.rows<int64_t, std::string_view>()) {
+            if (listed.count(name))
+                present.emplace(name);
+            else
+                stale.push_back(id);
+        }
+    }
+
+    for (auto id : stale)
+        conn.prepare_bind("delete from files where id = ?", id).exec();
+    stats.removed += stale.size();
+
+    for (auto &name : listing.files) {
+        if (present.count(name))
+            continue;
+        conn.prepare_bind("insert or ignore into files (path, name) values (?, ?)",
+                          join(dir, name), name).exec();
+        stats.added += sqlite3_changes(conn.db);
+    }
+
+    for (auto &gone : listing.gone) {
+        conn.prepare_bind("delete from files where path > ? and path < ?",
+                          gone + "/", gone + "0").exec();
+        stats.removed += sqlite3_changes(conn.db);
+        conn.prepare_bind("delete from dirs where path = ? or (path > ? and path < ?)",
+                          gone, gone + "/", gone + "0").exec();
+    }
+
+    conn.prepare_bind("insert or replace into dirs (path, mtime) values (?, ?)",
+                      dir, listing.mtime).exec();
+    stats.listed++;
+
+    return stale.size() + listing.files.size() - present.size() + 2 * listing.gone.size() + 1;
+}
+
+Scanner::Scanner(std::filesystem::path datadir, int datadirfd, std::string dbpath)
+    : datadir(std::move(datadir))
+    , datadirfd(datadirfd)
+    , dbpath(std::move(dbpath))
+{
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "failed to create eventfd");
+
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd < 0)
+        std::cerr << "Cannot watch datadir: " << strerror(errno) << std::endl;
+}
+
+Scanner::~Scanner() {
+    stop();
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    close(stop_fd);
+}
+
+/*
+ * Workers pop directories off a shared stack, push the subdirectories
+ * they find back on it and hand listings to a single thread storing
+ * them, since SQLite takes one writer at a time anyway.
+ */
+auto Scanner::scan(unsigned threads) -> Stats {
+    SQLite conn(dbpath.c_str());
+    sqlite3_busy_timeout(conn.db, 5000);
+    /* losing the last transactions on a crash only means scanning them again */
+    conn.exec("pragma foreign_keys = true; pragma synchronous = normal;");
+
+    std::unordered_map<std::string, int64_t> checkpoints;
+    std::unordered_map<std::string, std::vector<std::string>> children;
+    {
+        auto stmt = conn.prepare("select path, mtime from dirs");
+        for (auto [path, mtime] : stmt.rows<std::string, int64_t>()) {
+            checkpoints.emplace(path, mtime);
+            if (!path.empty())
+                children[parent_of(path)].push_back(std::move(path));
+        }
+    }
+
+    std::mutex work_mutex;
+    std::condition_variable work_cv;
+    std::vector<std::string> work{""};
+    unsigned busy = 0;
+
+    std::mutex listings_mutex;
+    std::condition_variable listings_cv;
+    std::deque<Listing> listings;
+    bool walked = false;
+
+    std::atomic<uint64_t> visited = 0;
+
+    auto visit = [&](const std::string &dir, std::vector<std::string> &subdirs) -> std::optional<Listing> {
+        int fd = open_dir(datadirfd, dir);
+        if (fd < 0) {
+            if (errno != ENOENT)
+                std::cerr << "Cannot scan " << dir << ": " << strerror(errno) << std::endl;
+            return {};
+        }
+
+        struct stat sb;
+        if (fstat(fd, &sb) != 0) {
+            close(fd);
+            return {};
+        }
+        visited++;
+        add_watch(dir);
+
+        auto known = children.find(dir);
+        auto mtime = nanoseconds(sb.st_mtim);
+        if (auto it = checkpoints.find(dir); it != checkpoints.end() && it->second == mtime && mtime) {
+            close(fd);
+            if (known != children.end())
+                subdirs = known->second;
+            return {};
+        }
+
+        Listing listing{dir, mtime, {}, {}};
+        if (!list(fd, dir, listing.files, subdirs))
+            return {};
+
+        if (known != children.end()) {
+            std::unordered_set<std::string_view> found(subdirs.begin(), subdirs.end());
+            for (auto &child : known->second)
+                if (!found.count(child))
+                    listing.gone.push_back(child);
+        }
+
+        /* a change within the same clock tick would not move the mtime */
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (nanoseconds(now) - mtime < 1000000000)
+            listing.mtime = 0;
+
+        return listing;
+    };
+
+    auto worker = [&] {
+        for (;;) {
+            std::string dir;
+            {
+                std::unique_lock lock(work_mutex);
+                work_cv.wait(lock, [&] { return !work.empty() || busy == 0; });
+                if (work.empty())
+                    return;
+                dir = std::move(work.back());
+                work.pop_back();
+                busy++;
+            }
+
+            std::vector<std::string> subdirs;
+            if (auto listing = visit(dir, subdirs)) {
+                std::lock_guard lock(listings_mutex);
+                listings.push_back(std::move(*listing));
+                listings_cv.notify_one();
+            }
+
+            {
+                std::lock_guard lock(work_mutex);
+                for (auto &subdir : subdirs)
+                    work.push_back(std::move(subdir));
+                busy--;
+            }
+            work_cv.notify_all();
+        }
+    };
+
+    Stats stats;
+    std::exception_ptr error;
+
+    auto storer = [&] {
+        try {
+            std::size_t rows = 0;
+            conn.prepare("begin immediate").exec();
+            for (;;) {
+                std::deque<Listing> batch;
+                {
+                    std::unique_lock lock(listings_mutex);
+                    listings_cv.wait(lock, [&] { return walked || !listings.empty(); });
+                    if (listings.empty())
+                        break;
+                    std::swap(batch, listings);
+                }
+                for (auto &listing : batch) {
+                    rows += store(conn, listing, stats);
+                    if (rows >= batch_rows) {
+                        conn.prepare("commit").exec();
+                        conn.prepare("begin immediate").exec();
+                        rows = 0;
+                    }
+                }
+            }
+            conn.prepare("commit").exec();
+        } catch (...) {
+            error = std::current_exception();
+            if (!sqlite3_get_autocommit(conn.db))
+                sqlite3_exec(conn.db, "rollback", nullptr, nullptr, nullptr);
+        }
+    };
+
+    std::thread storing(storer);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::max(threads, 1u); i++)
+        workers.emplace_back(worker);
+    for (auto &thread : workers)
+        thread.join();
+    {
+        std::lock_guard lock(listings_mutex);
+        walked = true;
+    }
+    listings_cv.notify_one();
+    storing.join();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    stats.visited = visited;
+    std::cerr << "Scanned " << stats.visited << " directories, listed " << stats.listed
+              << ": " << stats.added << " files added, " << stats.removed << " removed" << std::endl;
+    return stats;
+}
+
+auto Scanner::watch(Handler handler) -> void {
+    if (inotify_fd < 0)
+        return;
+    watcher = std::thread(&Scanner::watch_loop, this, std::move(handler));
+}
+
+auto Scanner::stop() -> void {
+    if (!watcher.joinable())
+        return;
+    uint64_t one = 1;
+    [[maybe_unused]] auto res = ::write(stop_fd, &one, sizeof one);
+    watcher.join();
+}
+
+auto Scanner::add_watch(const std::string &dir) -> void {
+    if (inotify_fd < 0)
+        return;
+
+    auto path = dir.empty() ? datadir : datadir / dir;
+    int wd = inotify_add_watch(inotify_fd, path.c_str(), watch_mask);
+
+    std::lock_guard lock(watches_mutex);
+    if (wd >= 0) {
+        watches[wd] = dir;
+    } else if (errno == ENOSPC && !watches_full) {
+        watches_full = true;
+        std::cerr << "Out of inotify watches, some changes will only be seen on the next mount"
+                  << std::endl;
+    }
+}
+
+static auto under(const std::string &path, const std::string &dir) -> bool {
+    return path.size() >= dir.size() && path.compare(0, dir.size(), dir) == 0
+        && (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+auto Scanner::drop_watches(const std::string &dir) -> void {
+    std::lock_guard lock(watches_mutex);
+    for (auto it = watches.begin(); it != watches.end();) {
+        if (under(it->second, dir)) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = watches.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+auto Scanner::move_watches(const std::string &from, const std::string &to) -> void {
+    std::lock_guard lock(watches_mutex);
+    for (auto &[wd, dir] : watches)
+        if (under(dir, from))
+            dir = to + dir.substr(from.size());
+}
+
+auto Scanner::walk_new(const std::string &dir, const Handler &handler) -> void {
+    /* watch first: whatever appears while listing is then reported twice, not missed */
+    add_watch(dir);
+    handler({Change::Created, true, dir, {}});
+
+    int fd = open_dir(datadirfd, dir);
+    if (fd < 0)
+        return;
+
+    std::vector<std::string> files, subdirs;
+    if (!list(fd, dir, files, subdirs))
+        return;
+
+    for (auto &name : files)
+        handler({Change::Created, false, join(dir, name), {}});
+    for (auto &subdir : subdirs)
+        walk_new(subdir, handler);
+}
+
+auto Scanner::watch_loop(Handler handler) -> void {
+    Handler report = [&](const Change &change) {
+        try {
+            handler(change);
+        } catch (std::exception &e) {
+            std::cerr << "Failed to apply change to " << change.path << ": " << e.what() << std::endl;
+        }
+    };
+
+    /*
+     * A move within the tree is a MOVED_FROM and a MOVED_TO sharing a
+     * cookie. The two are queued next to each other, but may still end
+     * up on either side of a read: a MOVED_FROM without its MOVED_TO
+     * waits for the next read, or `move_wait_ms` if none comes.
+     */
+    struct MovedFrom {
+        std::string path;
+        bool dir;
+        bool waited;
+    };
+    std::unordered_map<uint32_t, MovedFrom> moved;
+
+    /* the other half never came: moved out of the tree */
+    auto moved_out = [&](bool all) {
+        for (auto it = moved.begin(); it != moved.end();) {
+            auto &from = it->second;
+            if (!all && !from.waited) {
+                from.waited = true;
+                it++;
+                continue;
+            }
+            if (from.dir)
+                drop_watches(from.path);
+            report({Change::Deleted, from.dir, from.path, {}});
+            it = moved.erase(it);
+        }
+    };
+
+    alignas(struct inotify_event) char buf[64 * 1024];
+    struct pollfd fds[] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+
+    for (;;) {
+        int ready = poll(fds, 2, moved.empty() ? -1 : move_wait_ms);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        if (ready == 0) {
+            moved_out(true);
+            continue;
+        }
+
+        auto len = ::read(inotify_fd, buf, sizeof buf);
+        if (len <= 0)
+            continue;
+
+        for (char *p = buf; p < buf + len;) {
+            auto ev = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                report({Change::Overflow, false, {}, {}});
+                continue;
+            }
+
+            std::string dir;
+            {
+                std::lock_guard lock(watches_mutex);
+                auto it = watches.find(ev->wd);
+                if (it == watches.end())
+                    continue;
+                if (ev->mask & IN_IGNORED) {
+                    watches.erase(it);
+                    continue;
+                }
+                dir = it->second;
+            }
+            if (ev->len == 0 || is_db_file(dir, ev->name))
+                continue;
+
+            auto path = join(dir, ev->name);
+            bool isdir = ev->mask & IN_ISDIR;
+
+            if (ev->mask & IN_MOVED_FROM) {
+                moved[ev->cookie] = {path, isdir, false};
+                continue;
+            }
+            if (ev->mask & IN_MOVED_TO) {
+                if (auto from = moved.find(ev->cookie); from != moved.end()) {
+                    if (isdir)
+                        move_watches(from->second.path, path);
+                    report({Change::Moved, isdir, from->second.path, path});
+                    moved.erase(from);
+                    continue;
+                }
+            }
+
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                struct stat sb;
+                if (isdir)
+                    walk_new(path, report);
+                else if (fstatat(datadirfd, path.c_str(), &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(sb.st_mode))
+                    report({Change::Created, false, path, {}});
+            } else if (ev->mask & IN_DELETE) {
+                if (isdir)
+                    drop_watches(path);
+                report({Change::Deleted, isdir, path, {}});
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+                if (!isdir)
+                    report({Change::Modified, false, path, {}});
+            }
+        }
+
+        moved_out(false);
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/*
+ * Keeps `files` in step with what is actually in the data directory.
+ *
+ * `scan` walks the tree with a pool of threads and imports it through a
+ * connection of its own, in large transactions. The mtime of every
+ * directory listed is recorded in `dirs`: on the next scan a directory
+ * whose mtime did not change is not listed again, only descended into
+ * through the subdirectories recorded under it.
+ *
+ * Every directory visited is also watched with inotify, and `watch`
+ * reports what changes in them from then on.
+ */
+class Scanner {
+public:
+    struct Change {
+        enum Kind { Created, Deleted, Moved, Modified, Overflow };
+
+        Kind kind;
+        bool dir;
+        /* relative to the data directory */
+        std::string path;
+        /* where `path` was moved to */
+        std::string newpath;
+    };
+
+    using Handler = std::function<void(const Change &)>;
+
+    struct Stats {
+        uint64_t visited = 0;
+        uint64_t listed = 0;
+        uint64_t added = 0;
+        uint64_t removed = 0;
+    };
+
+private:
+    std::filesystem::path datadir;
+    int datadirfd;
+    std::string dbpath;
+
+    int inotify_fd;
+    int stop_fd;
+    /* watch descriptor -> directory */
+    std::mutex watches_mutex;
+    std::unordered_map<int, std::string> watches;
+    bool watches_full = false;
+    std::thread watcher;
+
+public:
+    Scanner(std::filesystem::path datadir, int datadirfd, std::string dbpath);
+    ~Scanner();
+
+    Scanner(const Scanner &) = delete;
+    Scanner &operator=(const Scanner &) = delete;
+
+    /* import what changed since the last scan, listing with `threads` workers */
+    auto scan(unsigned threads = std::thread::hardware_concurrency()) -> Stats;
+    /* report changes to `handler`, from a thread of its own, until stopped */
+    auto watch(Handler handler) -> void;
+    /* wait for `handler` to return, if running, and call it no more */
+    auto stop() -> void;
+
+private:
+    auto add_watch(const std::string &dir) -> void;
+    auto drop_watches(const std::string &dir) -> void;
+    auto move_watches(const std::string &from, const std::string &to) -> void;
+    /* report the content of a directory that just appeared as created */
+    auto walk_new(const std::string &dir, const Handler &) -> void;
+    auto watch_loop(Handler handler) -> void;
+};
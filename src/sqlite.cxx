@@ -6,11 +6,21 @@
 
 #include "sqlite.hxx"
 
-SQLite::SQLite(const char *path) {
+static const auto stmt_cache_hits = Stats::counter("sql.stmt_cache.hits");
+static const auto stmt_cache_misses = Stats::counter("sql.stmt_cache.misses");
+/* time from `commit` to its mutation being durable */
+static const auto commit_latency = Stats::histogram("commit.latency");
+/* mutations per transaction, and how many were waiting when it began */
+static const auto commit_batch = Stats::histogram("commit.batch");
+static const auto commit_queue = Stats::histogram("commit.queue");
+
+SQLite::SQLite(const char *path, int flags) {
     std::cerr << "Opening SQLite database " << path << std::endl;
-    int rc = sqlite3_open(path, &db);
-    if (rc != SQLITE_OK)
+    int rc = sqlite3_open_v2(path, &db, flags, NULL);
+    if (rc != SQLITE_OK) {
+        sqlite3_close(db);
         throw Error(rc);
+    }
 
     char *errormsg;
     rc = sqlite3_carray_init(db, &errormsg, NULL);
@@ -19,6 +29,9 @@ SQLite::SQLite(const char *path) {
 }
 
 SQLite::~SQLite() {
+    for (auto &&[query, stmts] : stmt_cache)
+        for (auto stmt : stmts.idle)
+            sqlite3_finalize(stmt);
     sqlite3_close(db);
 }
 
@@ -26,13 +39,50 @@ auto SQLite::error() const noexcept -> Error {
     return Error(this->db);
 }
 
+/* upper bound on idle statements kept around by one connection */
+static constexpr std::size_t max_cached_stmts = 256;
+
+/*
+ * Statements handed out by `prepare` come from a per-connection cache
+ * keyed by the query text; they are reset and their bindings cleared
+ * when the `Stmt` is destroyed, then kept for the next caller.
+ */
 auto SQLite::prepare(std::string_view query) -> Stmt {
-    sqlite3_stmt *stmt;
+    auto slot = stmt_cache.find(query);
+    if (slot == stmt_cache.end())
+        slot = stmt_cache.emplace(query, CachedStmts{{}, Stats::histogram("sql", query)}).first;
 
-    if (sqlite3_prepare_v2(db, query.data(), query.size(), &stmt, NULL))
+    if (!slot->second.idle.empty()) {
+        auto stmt = slot->second.idle.back();
+        slot->second.idle.pop_back();
+        stmt_cache_size--;
+        Stats::add(stmt_cache_hits);
+        return Stmt(*this, stmt, &slot->second);
+    }
+
+    Stats::add(stmt_cache_misses);
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v3(db, query.data(), query.size(),
+                           SQLITE_PREPARE_PERSISTENT, &stmt, NULL))
         throw this->error();
 
-    return Stmt(*this, stmt);
+    return Stmt(*this, stmt, &slot->second);
+}
+
+auto SQLite::release(
+    sqlite3_stmt *stmt,
+    CachedStmts *slot
+) const noexcept -> void {
+    if (stmt_cache_size >= max_cached_stmts) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    slot->idle.push_back(stmt);
+    stmt_cache_size++;
 }
 
 static auto can_prerpare(std::optional<std::string_view> query) -> bool {
@@ -61,19 +111,47 @@ auto SQLite::prepare_all(std::string_view query) -> std::list<Stmt> {
     return list;
 }
 
+/*
+ * Each statement is run before the next one is prepared, so a script may
+ * refer to tables created earlier in the same script.
+ */
 auto SQLite::exec(std::string_view query) -> void {
-    auto stmts = this->prepare_all(query);
-    for (auto &&stmt : stmts)
-        stmt.exec();
+    std::optional<std::string_view> remaining = query;
+
+    while (can_prerpare(remaining)) {
+        sqlite3_stmt *stmt;
+        const char *s = nullptr;
+        if (sqlite3_prepare_v2(db, remaining->data(), remaining->size(), &stmt, &s))
+            throw this->error();
+        remaining = std::string_view(s, remaining->data() + remaining->size() - s);
+        if (stmt)
+            Stmt(*this, stmt).exec();
+    }
 }
 
-SQLite::Stmt::Stmt(const SQLite &db, sqlite3_stmt *stmt)
+SQLite::Stmt::Stmt(
+    const SQLite &db,
+    sqlite3_stmt *stmt,
+    CachedStmts *cache_slot
+)
     : db(db)
     , stmt(stmt)
+    , cache_slot(cache_slot)
+{}
+
+SQLite::Stmt::Stmt(Stmt &&other) noexcept
+    : db(other.db)
+    , stmt(std::exchange(other.stmt, nullptr))
+    , cache_slot(other.cache_slot)
+    , started(std::exchange(other.started, 0))
 {}
 
 SQLite::Stmt::~Stmt() {
-    sqlite3_finalize(stmt);
+    finished();
+    if (cache_slot && stmt)
+        db.release(stmt, cache_slot);
+    else
+        sqlite3_finalize(stmt);
 }
 
 auto SQLite::Stmt::error() const noexcept -> Error {
@@ -95,9 +173,30 @@ auto SQLite::Stmt::bind(int id, std::string_view text) -> void {
         throw this->error();
 }
 
+auto SQLite::Stmt::bind(int id, const std::vector<int64_t> &vals) -> void {
+    if (sqlite3_carray_bind(stmt, id, const_cast<int64_t *>(vals.data()),
+                            vals.size(), CARRAY_INT64, SQLITE_TRANSIENT))
+        throw this->error();
+}
+
+auto SQLite::Stmt::finished() noexcept -> void {
+    if (started)
+        Stats::record(cache_slot->metric, Stats::now() - started);
+    started = 0;
+}
+
+/*
+ * Only cached statements are timed: they are the ones with a metric. The
+ * clock is read when a run starts and when it ends, not around every row.
+ */
 auto SQLite::Stmt::step() -> std::optional<Row> {
-    switch (sqlite3_step(stmt)) {
+    if (cache_slot && !started)
+        started = Stats::now();
+    int rc = sqlite3_step(stmt);
+
+    switch (rc) {
     case SQLITE_DONE:
+        finished();
         return {};
     case SQLITE_ROW:
         return Row(*this);
@@ -117,6 +216,10 @@ SQLite::Row::Row(const Stmt &stmt)
 
 SQLite::Row::~Row() = default;
 
+auto SQLite::Row::column_null(int i) -> bool {
+    return sqlite3_column_type(stmt.stmt, i) == SQLITE_NULL;
+}
+
 auto SQLite::Row::column_int(int i) -> int {
     return sqlite3_column_int(stmt.stmt, i);
 }
@@ -126,9 +229,189 @@ auto SQLite::Row::column_int64(int i) -> int64_t {
 }
 
 auto SQLite::Row::column_text(int i) -> std::string_view {
-    return reinterpret_cast<const char *>(sqlite3_column_text(stmt.stmt, i));
+    /* text first, then its length, as the conversion may change it */
+    auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt.stmt, i));
+    if (!text)
+        return {};
+    return {text, static_cast<std::size_t>(sqlite3_column_bytes(stmt.stmt, i))};
+}
+
+/* how long a connection retries on `SQLITE_BUSY` before giving up */
+static constexpr int busy_timeout_ms = 5000;
+
+SQLite::Pool::Pool(std::string path)
+    : path(std::move(path))
+    , writer_db(this->path.c_str(),
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX)
+{
+    sqlite3_busy_timeout(writer_db.db, busy_timeout_ms);
+    writer_db.exec(R"(
+pragma journal_mode = wal;
+pragma synchronous = full;
+pragma foreign_keys = true;
+pragma recursive_triggers = true;
+)");
+
+    committer = std::thread(&Pool::commit_loop, this);
+}
+
+SQLite::Pool::~Pool() {
+    {
+        std::lock_guard lock(queue_mutex);
+        queue_stop = true;
+    }
+    queue_cv.notify_one();
+    committer.join();
 }
 
+auto SQLite::Pool::reader() -> Reader {
+    {
+        std::lock_guard lock(readers_mutex);
+        if (!idle_readers.empty()) {
+            auto db = std::move(idle_readers.back());
+            idle_readers.pop_back();
+            return Reader(*this, std::move(db));
+        }
+    }
+
+    auto db = std::make_unique<SQLite>(path.c_str(),
+        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX);
+    sqlite3_busy_timeout(db->db, busy_timeout_ms);
+    return Reader(*this, std::move(db));
+}
+
+auto SQLite::Pool::writer() -> Writer {
+    return Writer(writer_mutex, writer_db);
+}
+
+auto SQLite::Pool::queue_depth() -> std::size_t {
+    std::lock_guard lock(queue_mutex);
+    return queue.size();
+}
+
+auto SQLite::Pool::idle_readers_count() -> std::size_t {
+    std::lock_guard lock(readers_mutex);
+    return idle_readers.size();
+}
+
+auto SQLite::Pool::commit(Mutation mutation) -> void {
+    Stats::Timer timer(commit_latency);
+    std::future<void> done;
+    {
+        std::lock_guard lock(queue_mutex);
+        queue.push_back(Pending{std::move(mutation), {}, {}, {}});
+        done = queue.back().done.get_future();
+    }
+    queue_cv.notify_one();
+    done.get();
+}
+
+auto SQLite::Pool::on_rollback(std::function<void()> undo) -> void {
+    applying->undo.push_back(std::move(undo));
+}
+
+/* newest first, and only once */
+static auto take_back(std::vector<std::function<void()>> &undo) noexcept -> void {
+    for (auto it = undo.rbegin(); it != undo.rend(); it++) {
+        try {
+            (*it)();
+        } catch (...) {}
+    }
+    undo.clear();
+}
+
+auto SQLite::Pool::commit_loop() -> void {
+    for (;;) {
+        {
+            std::unique_lock lock(queue_mutex);
+            queue_cv.wait(lock, [&] { return queue_stop || !queue.empty(); });
+            if (queue.empty())
+                return;
+            Stats::record(commit_queue, queue.size());
+        }
+
+        auto db = writer();
+        std::vector<Pending> batch;
+        std::vector<std::function<void()>> after;
+
+        try {
+            db->prepare("begin immediate").exec();
+
+            auto deadline = std::chrono::steady_clock::now() + max_batch_time;
+            while (batch.size() < max_batch && std::chrono::steady_clock::now() < deadline) {
+                {
+                    std::lock_guard lock(queue_mutex);
+                    if (queue.empty())
+                        break;
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+
+                auto &pending = batch.back();
+                db->prepare("savepoint mutation").exec();
+                applying = &pending;
+                try {
+                    after.push_back(pending.mutation(*db));
+                    applying = nullptr;
+                } catch (...) {
+                    applying = nullptr;
+                    db->prepare("rollback to mutation").exec();
+                    take_back(pending.undo);
+                    pending.error = std::current_exception();
+                    after.emplace_back();
+                }
+                db->prepare("release mutation").exec();
+            }
+
+            db->prepare("commit").exec();
+            Stats::record(commit_batch, batch.size());
+        } catch (...) {
+            if (!sqlite3_get_autocommit(db->db))
+                sqlite3_exec(db->db, "rollback", nullptr, nullptr, nullptr);
+            for (auto pending = batch.rbegin(); pending != batch.rend(); pending++)
+                take_back(pending->undo);
+            for (auto &pending : batch)
+                pending.done.set_exception(std::current_exception());
+            continue;
+        }
+
+        for (std::size_t i = 0; i < batch.size(); i++) {
+            auto &pending = batch[i];
+            if (pending.error) {
+                pending.done.set_exception(pending.error);
+                continue;
+            }
+            try {
+                if (after[i])
+                    after[i]();
+                pending.done.set_value();
+            } catch (...) {
+                pending.done.set_exception(std::current_exception());
+            }
+        }
+    }
+}
+
+auto SQLite::Pool::release(std::unique_ptr<SQLite> db) -> void {
+    std::lock_guard lock(readers_mutex);
+    idle_readers.push_back(std::move(db));
+}
+
+SQLite::Pool::Reader::Reader(Pool &pool, std::unique_ptr<SQLite> db)
+    : pool(pool)
+    , db(std::move(db))
+{}
+
+SQLite::Pool::Reader::~Reader() {
+    if (db)
+        pool.release(std::move(db));
+}
+
+SQLite::Pool::Writer::Writer(std::mutex &mutex, SQLite &db)
+    : lock(mutex)
+    , db(db)
+{}
+
 SQLite::Error::Error(int code) noexcept
     : msg(sqlite3_errstr(code))
 {}
@@ -1,11 +1,28 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <sqlite3.h>
 #include "carray.h"
 
+#include "stats.hxx"
+
 class SQLite {
 public:
     sqlite3 *db;
@@ -13,16 +30,36 @@ public:
     class Stmt;
     class Error;
     class Row;
+    template<typename... TS>
+    class Rows;
+    class Pool;
 
-    SQLite(const char *path);
+    SQLite(const char *path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
     ~SQLite();
 
+    SQLite(const SQLite &) = delete;
+    SQLite &operator=(const SQLite &) = delete;
+
     auto error() const noexcept -> Error;
     auto prepare(std::string_view query) -> Stmt;
     auto prepare_all(std::string_view query) -> std::list<Stmt>;
     template<typename... TS>
     auto prepare_bind(std::string_view query, TS... binds) -> Stmt;
     auto exec(std::string_view query) -> void;
+
+private:
+    struct CachedStmts {
+        std::vector<sqlite3_stmt *> idle;
+        /* time from the first step of a run to its end, shared by every connection */
+        Stats::Metric metric;
+    };
+
+    /* idle prepared statements, keyed by their query text */
+    using StmtCache = std::map<std::string, CachedStmts, std::less<>>;
+    mutable StmtCache stmt_cache;
+    mutable std::size_t stmt_cache_size = 0;
+
+    auto release(sqlite3_stmt *, CachedStmts *) const noexcept -> void;
 };
 
 class SQLite::Stmt {
@@ -30,23 +67,49 @@ public:
     const SQLite &db;
     sqlite3_stmt *stmt;
 
-    Stmt(const SQLite &, sqlite3_stmt *);
+    Stmt(const SQLite &, sqlite3_stmt *, CachedStmts *cache_slot = nullptr);
+    Stmt(Stmt &&) noexcept;
     ~Stmt();
 
+    Stmt(const Stmt &) = delete;
+    Stmt &operator=(const Stmt &) = delete;
+
     auto error() const noexcept -> Error;
 
     auto bind(int id, int) -> void;
     auto bind(int id, int64_t) -> void;
     auto bind(int id, std::string_view) -> void;
-    template<typename T, typename... TS>
-    auto bind(int start_id, T first_bind, TS... rest) -> void;
+    /* bound as a `carray` of 64-bit integers, copied */
+    auto bind(int id, const std::vector<int64_t> &) -> void;
+    template<typename T, typename U, typename... TS>
+    auto bind(int start_id, T first_bind, U second_bind, TS... rest) -> void;
 
     auto step() -> std::optional<Row>;
     auto exec() -> void;
+    /* call `f` on every row, see `Row::call` */
     template<typename F>
     auto iterate(F &&f) -> void;
+    /* every row, decoded as `Row::as<TS...>` */
+    template<typename... TS>
+    auto rows() & -> Rows<TS...>;
+    template<typename... TS>
+    auto rows() && -> Rows<TS...>;
+
+private:
+    /* where the statement goes back to when released, if it came from the cache */
+    CachedStmts *cache_slot;
+    /* when the current run took its first step, 0 if none is under way */
+    uint64_t started = 0;
+
+    /* record the run that just ended, if any */
+    auto finished() noexcept -> void;
 };
 
+/*
+ * The current row of a statement. Text is not copied: a `string_view`
+ * read from it points into the statement and is only valid until it
+ * steps again or goes away.
+ */
 class SQLite::Row {
 public:
     const Stmt &stmt;
@@ -54,23 +117,192 @@ public:
     Row(const Stmt &);
     ~Row();
 
+    auto column_null(int) -> bool;
     auto column_int(int) -> int;
     auto column_int64(int) -> int64_t;
-    /* WARNING: resulting `string_view` validity */
+    /* empty for NULL */
     auto column_text(int) -> std::string_view;
 
-private:
-    auto _call(int, std::function<auto() -> void>) -> void;
-    template<typename... TS>
-    auto _call(int, std::function<auto(int, TS...) -> void>) -> void;
+    /*
+     * Column `i` as `T`: `int`, `int64_t`, `std::string_view`,
+     * `std::string`, or an optional of one of them that is empty for NULL.
+     */
+    template<typename T>
+    auto get(int i) -> T;
+    /* the leading columns, one per type */
     template<typename... TS>
-    auto _call(int, std::function<auto(int64_t, TS...) -> void>) -> void;
-    template<typename... TS>
-    auto _call(int, std::function<auto(std::optional<std::string_view>, TS...) -> void>) -> void;
+    auto as() -> std::tuple<TS...>;
+    /* call `f` with the leading columns, as the types of its parameters */
+    template<typename F>
+    auto call(F &&f) -> void;
 
-public:
+private:
+    template<typename T>
+    struct is_optional : std::false_type {};
+    template<typename T>
+    struct is_optional<std::optional<T>> : std::true_type {};
+
+    /* the parameter types of a callable, to decode into */
     template<typename F>
-    auto call(int n, F &&f) -> void;
+    struct Params : Params<decltype(&F::operator())> {};
+    template<typename R, typename... AS>
+    struct Params<R (*)(AS...)> {
+        static auto decode(Row &row) { return row.as<std::decay_t<AS>...>(); }
+    };
+    template<typename C, typename R, typename... AS>
+    struct Params<R (C::*)(AS...)> : Params<R (*)(AS...)> {};
+    template<typename C, typename R, typename... AS>
+    struct Params<R (C::*)(AS...) const> : Params<R (*)(AS...)> {};
+
+    template<typename... TS, std::size_t... IS>
+    auto as(std::index_sequence<IS...>) -> std::tuple<TS...>;
+};
+
+/*
+ * The rows of a statement, for a range-based `for`. Decodes each row in
+ * place, without allocating. Holds on to the statement when made from a
+ * temporary one, but not to the connection: keep a `Pool::Reader` in a
+ * variable while iterating.
+ */
+template<typename... TS>
+class SQLite::Rows {
+    std::optional<Stmt> owned;
+    Stmt *stmt;
+
+public:
+    class Iterator {
+        Stmt *stmt;
+
+    public:
+        Iterator(Stmt *stmt) : stmt(stmt) { ++*this; }
+
+        auto operator*() const -> std::tuple<TS...> { return Row(*stmt).as<TS...>(); }
+        auto operator!=(const Iterator &other) const noexcept -> bool { return stmt != other.stmt; }
+        auto operator++() -> Iterator & {
+            if (stmt && !stmt->step())
+                stmt = nullptr;
+            return *this;
+        }
+    };
+
+    Rows(Stmt &stmt) : stmt(&stmt) {}
+    Rows(Stmt &&stmt) : owned(std::move(stmt)), stmt(&*owned) {}
+
+    Rows(const Rows &) = delete;
+    Rows &operator=(const Rows &) = delete;
+
+    auto begin() -> Iterator { return Iterator(stmt); }
+    auto end() -> Iterator { return Iterator(nullptr); }
+};
+
+/*
+ * One writer connection and any number of read-only connections to the
+ * same database, which is switched to WAL mode so readers never wait on
+ * the writer. Readers are leased: a thread takes an idle connection (or
+ * opens a new one) and gives it back when the lease goes out of scope,
+ * so each concurrent FUSE worker ends up with its own `sqlite3 *`.
+ *
+ * Changes go through `commit`: a single thread drains the queued
+ * mutations and applies as many as it can in one transaction, so
+ * concurrent writers share the cost of a sync instead of paying one
+ * each.
+ */
+class SQLite::Pool {
+public:
+    /*
+     * A change, applied with the writer connection inside its own
+     * savepoint of the batch transaction. What it returns runs once the
+     * batch is committed, in the order mutations were submitted.
+     */
+    using Mutation = std::function<std::function<void()>(SQLite &)>;
+
+    /* a batch stops taking mutations at either bound, then commits */
+    static constexpr std::size_t max_batch = 1024;
+    static constexpr std::chrono::milliseconds max_batch_time{10};
+
+private:
+    struct Pending {
+        Mutation mutation;
+        std::promise<void> done;
+        std::exception_ptr error;
+        /* see `on_rollback` */
+        std::vector<std::function<void()>> undo;
+    };
+
+    std::string path;
+
+    std::mutex writer_mutex;
+    SQLite writer_db;
+
+    std::mutex readers_mutex;
+    std::vector<std::unique_ptr<SQLite>> idle_readers;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<Pending> queue;
+    bool queue_stop = false;
+    std::thread committer;
+    /* the mutation the committer is applying */
+    Pending *applying = nullptr;
+
+public:
+    class Reader;
+    class Writer;
+
+    Pool(std::string path);
+    ~Pool();
+
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+
+    auto reader() -> Reader;
+    auto writer() -> Writer;
+
+    /* mutations waiting for the committer */
+    auto queue_depth() -> std::size_t;
+    auto idle_readers_count() -> std::size_t;
+
+    /*
+     * Queue `mutation` and wait until the transaction it ended up in is
+     * durable and its follow-up has run. Rethrows what it threw, in
+     * which case only its own savepoint was rolled back.
+     */
+    auto commit(Mutation mutation) -> void;
+
+    /*
+     * For a mutation to call: `undo` runs if what it did is rolled back
+     * after all, with its savepoint or the whole batch, to take back a
+     * change it made outside the database. It must not throw.
+     */
+    auto on_rollback(std::function<void()> undo) -> void;
+
+private:
+    auto release(std::unique_ptr<SQLite>) -> void;
+    auto commit_loop() -> void;
+};
+
+class SQLite::Pool::Reader {
+    Pool &pool;
+    std::unique_ptr<SQLite> db;
+
+public:
+    Reader(Pool &, std::unique_ptr<SQLite>);
+    Reader(Reader &&) = default;
+    ~Reader();
+
+    auto operator*() -> SQLite & { return *db; }
+    auto operator->() -> SQLite * { return db.get(); }
+};
+
+class SQLite::Pool::Writer {
+    std::unique_lock<std::mutex> lock;
+    SQLite &db;
+
+public:
+    Writer(std::mutex &, SQLite &);
+
+    auto operator*() -> SQLite & { return db; }
+    auto operator->() -> SQLite * { return &db; }
 };
 
 class SQLite::Error : public std::exception {
@@ -92,59 +324,57 @@ auto SQLite::prepare_bind(std::string_view query, TS... binds) -> Stmt {
     return stmt;
 }
 
-template<typename T, typename... TS>
-auto SQLite::Stmt::bind(int id, T first_bind, TS... rest) -> void {
+template<typename T, typename U, typename... TS>
+auto SQLite::Stmt::bind(int id, T first_bind, U second_bind, TS... rest) -> void {
     this->bind(id, first_bind);
-    this->bind(id + 1, rest...);
+    this->bind(id + 1, second_bind, rest...);
 }
 
 template<typename F>
 auto SQLite::Stmt::iterate(F &&f) -> void {
     while (auto r = this->step())
-        r->call(0, std::forward<F>(f));
+        r->call(f);
 }
 
-template<typename F>
-auto SQLite::Row::call(int n, F &&f) -> void {
-        this->_call(n, std::function(f));
+template<typename... TS>
+auto SQLite::Stmt::rows() & -> Rows<TS...> {
+    return Rows<TS...>(*this);
 }
 
-inline auto SQLite::Row::_call(
-    [[maybe_unused]] int n,
-    std::function<auto() -> void> f
-) -> void {
-    f();
+template<typename... TS>
+auto SQLite::Stmt::rows() && -> Rows<TS...> {
+    return Rows<TS...>(std::move(*this));
 }
 
-template<typename... TS>
-auto SQLite::Row::_call(
-    int n,
-    std::function<auto(int, TS...) -> void> f
-) -> void {
-    auto c = this->column_int(n);
-    this->call(n + 1, [=](TS... args) -> void {
-        f(c, args...);
-    });
+template<typename T>
+auto SQLite::Row::get(int i) -> T {
+    if constexpr (is_optional<T>::value) {
+        if (this->column_null(i))
+            return std::nullopt;
+        return this->get<typename T::value_type>(i);
+    } else if constexpr (std::is_same_v<T, int>) {
+        return this->column_int(i);
+    } else if constexpr (std::is_same_v<T, int64_t>) {
+        return this->column_int64(i);
+    } else if constexpr (std::is_same_v<T, std::string_view>) {
+        return this->column_text(i);
+    } else {
+        static_assert(std::is_same_v<T, std::string>, "unsupported column type");
+        return std::string(this->column_text(i));
+    }
 }
 
 template<typename... TS>
-auto SQLite::Row::_call(
-    int n,
-    std::function<auto(int64_t, TS...) -> void> f
-) -> void {
-    auto c = this->column_int64(n);
-    this->call(n + 1, [=](TS... args) -> void {
-        f(c, args...);
-    });
+auto SQLite::Row::as() -> std::tuple<TS...> {
+    return this->as<TS...>(std::index_sequence_for<TS...>());
 }
 
-template<typename... TS>
-auto SQLite::Row::_call(
-    int n,
-    std::function<auto(std::optional<std::string_view>, TS...) -> void> f
-) -> void {
-    auto c = this->column_text(n);
-    this->call(n + 1, [=](TS... args) -> void {
-        f(c, args...);
-    });
+template<typename... TS, std::size_t... IS>
+auto SQLite::Row::as(std::index_sequence<IS...>) -> std::tuple<TS...> {
+    return {this->get<TS>(IS)...};
+}
+
+template<typename F>
+auto SQLite::Row::call(F &&f) -> void {
+    std::apply(f, Params<std::decay_t<F>>::decode(*this));
 }
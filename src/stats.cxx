@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "stats.hxx"
+
+struct Stats::Registry {
+    std::mutex mutex;
+    /* by (name, label) */
+    std::map<std::pair<std::string, std::string>, Metric, std::less<>> ids;
+    std::vector<Summary> metrics;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    /* left behind by threads that exited */
+    std::vector<Shard *> idle;
+};
+
+auto Stats::registry() -> Registry & {
+    /* never destroyed: threads may still record while the process exits */
+    static auto registry = new Registry();
+    return *registry;
+}
+
+auto Stats::shard() -> Shard & {
+    thread_local struct Lease {
+        Shard *shard = nullptr;
+
+        ~Lease() {
+            if (!shard)
+                return;
+            auto &r = registry();
+            std::lock_guard lock(r.mutex);
+            r.idle.push_back(shard);
+        }
+    } lease;
+
+    if (!lease.shard) {
+        auto &r = registry();
+        std::lock_guard lock(r.mutex);
+        if (!r.idle.empty()) {
+            lease.shard = r.idle.back();
+            r.idle.pop_back();
+        } else {
+            lease.shard = r.shards.emplace_back(std::make_unique<Shard>()).get();
+        }
+    }
+    return *lease.shard;
+}
+
+auto Stats::register_metric(
+    std::string_view name,
+    std::string_view label,
+    bool histogram
+) -> Metric {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+
+    if (r.metrics.empty()) {
+        r.metrics.push_back({"overflow", {}, true});
+        r.ids.emplace(std::pair(std::string("overflow"), std::string()), 0);
+    }
+
+    auto key = std::pair(std::string(name), std::string(label));
+    if (auto it = r.ids.find(key); it != r.ids.end())
+        return it->second;
+    if (r.metrics.size() == max_metrics)
+        return 0;
+
+    Metric id = r.metrics.size();
+    r.metrics.push_back({key.first, key.second, histogram});
+    r.ids.emplace(std::move(key), id);
+    return id;
+}
+
+auto Stats::counter(std::string_view name, std::string_view label) -> Metric {
+    return register_metric(name, label, false);
+}
+
+auto Stats::histogram(std::string_view name, std::string_view label) -> Metric {
+    return register_metric(name, label, true);
+}
+
+/* only the owning thread writes to a shard, so no read-modify-write is needed */
+static auto bump(std::atomic<uint64_t> &n, uint64_t by) noexcept -> void {
+    n.store(n.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+auto Stats::add(Metric metric, uint64_t n) noexcept -> void {
+    bump(shard().slots[metric].count, n);
+}
+
+auto Stats::record(Metric metric, uint64_t value) noexcept -> void {
+    auto &slot = shard().slots[metric];
+    std::size_t bucket = value ? 63 - __builtin_clzll(value) : 0;
+    bump(slot.count, 1);
+    bump(slot.sum, value);
+    if (value > slot.max.load(std::memory_order_relaxed))
+        slot.max.store(value, std::memory_order_relaxed);
+    bump(slot.hist[std::min(bucket, buckets - 1)], 1);
+}
+
+auto Stats::now() noexcept -> uint64_t {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+auto Stats::read() -> std::vector<Summary> {
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+
+    auto res = r.metrics;
+    for (auto &shard : r.shards) {
+        for (std::size_t i = 0; i < res.size(); i++) {
+            auto &slot = shard->slots[i];
+            res[i].count += slot.count.load(std::memory_order_relaxed);
+            res[i].sum += slot.sum.load(std::memory_order_relaxed);
+            res[i].max = std::max(res[i].max, slot.max.load(std::memory_order_relaxed));
+            for (std::size_t b = 0; b < buckets; b++)
+                res[i].hist[b] += slot.hist[b].load(std::memory_order_relaxed);
+        }
+    }
+    return res;
+}
+
+auto Stats::Summary::quantile(double q) const -> uint64_t {
+    uint64_t seen = 0;
+    for (std::size_t b = 0; b < buckets; b++) {
+        seen += hist[b];
+        if (seen && seen >= q * count)
+            return (uint64_t(2) << b) - 1;
+    }
+    return 0;
+}
+
+auto Stats::report(std::ostream &out) -> void {
+    for (auto &m : read()) {
+        if (!m.count)
+            continue;
+
+        out << m.name;
+        if (!m.histogram) {
+            out << " value=" << m.count;
+        } else {
+            out << " count=" << m.count << " sum=" << m.sum
+                << " p50=" << m.quantile(0.5) << " p90=" << m.quantile(0.9)
+                << " p99=" << m.quantile(0.99) << " max=" << m.max << " buckets=";
+            const char *sep = "";
+            for (std::size_t b = 0; b < buckets; b++) {
+                if (m.hist[b]) {
+                    out << sep << b << ':' << m.hist[b];
+                    sep = ",";
+                }
+            }
+        }
+        /* on one line, whatever the label looks like */
+        bool space = true;
+        for (unsigned char c : m.label) {
+            if (!std::isspace(c))
+                out << (space ? " " : "") << c;
+            space = std::isspace(c);
+        }
+        out << '\n';
+    }
+}
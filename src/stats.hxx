@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Process-wide counters and histograms, cheap enough to record on every
+ * request. Each thread writes to a shard of its own with plain relaxed
+ * stores, and `read` sums the shards. A shard outlives its thread and
+ * goes to the next one started, so nothing recorded is lost.
+ *
+ * Metrics are registered once by name, plus a label telling apart those
+ * of the same kind (the text of a query), and then referred to by index.
+ * Histograms have log2 buckets; those filled by `Timer` are in
+ * nanoseconds.
+ */
+class Stats {
+public:
+    using Metric = uint32_t;
+
+    /* past this, new metrics all share the first one, `overflow` */
+    static constexpr std::size_t max_metrics = 256;
+    /* bucket `i` counts values in [2^i, 2^(i+1)), bucket 0 also 0 */
+    static constexpr std::size_t buckets = 40;
+
+    struct Summary {
+        std::string name;
+        std::string label;
+        bool histogram;
+        /* values recorded, or the counter's total */
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        /* largest value recorded */
+        uint64_t max = 0;
+        std::array<uint64_t, buckets> hist{};
+
+        /* upper bound of the bucket holding quantile `q` */
+        auto quantile(double q) const -> uint64_t;
+    };
+
+    class Timer {
+        Metric metric;
+        uint64_t start;
+
+    public:
+        Timer(Metric metric) noexcept : metric(metric), start(now()) {}
+        ~Timer() { record(metric, now() - start); }
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+    };
+
+    static auto counter(std::string_view name, std::string_view label = {}) -> Metric;
+    static auto histogram(std::string_view name, std::string_view label = {}) -> Metric;
+
+    static auto add(Metric, uint64_t n = 1) noexcept -> void;
+    static auto record(Metric, uint64_t value) noexcept -> void;
+    /* monotonic, in nanoseconds */
+    static auto now() noexcept -> uint64_t;
+
+    static auto read() -> std::vector<Summary>;
+    /*
+     * One line per metric recorded at least once: its name, `key=value`
+     * fields, then its label if it has one, up to the end of the line.
+     */
+    static auto report(std::ostream &) -> void;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+        std::array<std::atomic<uint64_t>, buckets> hist{};
+    };
+
+    struct Shard {
+        std::array<Slot, max_metrics> slots;
+    };
+
+    struct Registry;
+
+    static auto registry() -> Registry &;
+    static auto shard() -> Shard &;
+    static auto register_metric(std::string_view name, std::string_view label, bool histogram) -> Metric;
+};
@@ -1,17 +1,199 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <sstream>
+#include <system_error>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "tagfs.hxx"
 
+/* `d_ino` reported by `readdir` for directories the kernel has not looked up */
+static constexpr fuse_ino_t unknown_ino = 0xffffffff;
+
+/* `/q` and `/.yatagfs`, see `TagFS::next_node` */
+static constexpr fuse_ino_t queries_ino = 2;
+static constexpr std::string_view queries_name = "q";
+static constexpr fuse_ino_t meta_ino = 4;
+static constexpr std::string_view meta_name = ".yatagfs";
+
+/* `/.yatagfs/stats`: the file inode of the last id SQLite would hand out */
+static constexpr fuse_ino_t stats_ino = ~fuse_ino_t(0);
+static constexpr std::string_view stats_name = "stats";
+
+/* most tags or files a listing reads from the database at a time */
+static constexpr std::size_t max_page = 1024;
+
+/*
+ * A readdir offset is where the next call resumes: which part of the
+ * listing, and the last id returned from it (the number of entries, for
+ * `.`, `..` and `q`). Listings page through tables and the index by id
+ * rather than copying the directory, so entries that come or go while it
+ * is read show up or not, as in any directory, and memory stays flat.
+ */
+enum Part : off_t { dot_part, tag_part, file_part, end_part };
+static constexpr int part_shift = 60;
+
+static auto cursor(Part part, int64_t id) -> off_t {
+    return static_cast<off_t>(part) << part_shift | id;
+}
+
+/*
+ * How long the kernel may keep entries and attributes. Changes made
+ * through the mount invalidate what it cached, so this can be long.
+ */
+static constexpr double kernel_timeout = 30.0;
+
+static auto file_ino(int64_t id) -> fuse_ino_t {
+    return static_cast<fuse_ino_t>(id) << 1 | 1;
+}
+
+static auto is_file(fuse_ino_t ino) -> bool {
+    return ino != FUSE_ROOT_ID && (ino & 1);
+}
+
+static auto file_id(fuse_ino_t ino) -> int64_t {
+    return static_cast<int64_t>(ino >> 1);
+}
+
+/* names in the root that are not tags */
+static auto reserved(std::string_view name) -> bool {
+    return name == queries_name || name == meta_name;
+}
+
+static auto contains(const std::vector<int64_t> &tags, int64_t tag) -> bool {
+    return std::binary_search(tags.begin(), tags.end(), tag);
+}
+
+/* a tag shows up everywhere, hiding the files of its name in the root */
+static auto file_named(SQLite &conn, std::string_view name) -> bool {
+    return conn.prepare_bind("select 1 from files where name = ? limit 1", name).step().has_value();
+}
+
+/* both sorted */
+static auto intersects(
+    const std::vector<int64_t> &a,
+    const std::vector<int64_t> &b
+) -> bool {
+    for (auto i = a.begin(), j = b.begin(); i != a.end() && j != b.end();) {
+        if (*i < *j)
+            i++;
+        else if (*j < *i)
+            j++;
+        else
+            return true;
+    }
+    return false;
+}
+
+static auto merge(
+    const std::vector<int64_t> &a,
+    const std::vector<int64_t> &b
+) -> std::vector<int64_t> {
+    std::vector<int64_t> res;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(),
+                   std::back_inserter(res));
+    return res;
+}
+
+static auto difference(
+    const std::vector<int64_t> &a,
+    const std::vector<int64_t> &b
+) -> std::vector<int64_t> {
+    std::vector<int64_t> res;
+    std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+                        std::back_inserter(res));
+    return res;
+}
+
+/*
+ * `db.commit(mutation)` for one that changes the data directory in a way
+ * that cannot be taken back. Once it sets `done`, that change stands
+ * however the batch ends, so a failure is not reported; the watcher sees
+ * the change and brings the rows in line, as for one made behind our back.
+ */
+static auto commit_on_disk(SQLite::Pool &db, const bool &done, SQLite::Pool::Mutation mutation) -> void {
+    try {
+        db.commit(std::move(mutation));
+    } catch (...) {
+        if (!done)
+            throw;
+    }
+}
+
+struct TagFS::FileHandle {
+    int fd;
+    int64_t id;
+    /* registered with the kernel for passthrough, 0 if not */
+    int backing_id;
+    bool writable;
+    /* what reads return when there is no backing file, `fd` being -1 */
+    std::string content;
+};
+
+static auto open_datadir(const std::filesystem::path &datadir) -> int {
+    int fd = ::open(datadir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "failed to open datadir");
+    return fd;
+}
+
 TagFS::TagFS(int argc, char **argv, std::filesystem::path datadir)
-    : Fuse(argc, argv)
-    , db((datadir / ".yatagfs.db").c_str())
+    : FuseLowlevel(argc, argv)
+    , db(datadir / ".yatagfs.db")
+    , cache(1 << 18, 1 << 16, 1024)
+    , datadirfd(open_datadir(datadir))
+    , scanner(datadir, datadirfd, datadir / ".yatagfs.db")
 {
-    db.exec("pragma recursive_triggers = true");
+    entry_timeout = kernel_timeout;
+    attr_timeout = kernel_timeout;
+    negative_timeout = kernel_timeout;
 
-    db.exec(R"(
+    if (fstat(datadirfd, &datadir_attr) != 0)
+        throw std::system_error(errno, std::generic_category(), "failed to stat datadir");
+
+    nodes.emplace(FUSE_ROOT_ID, Node{FUSE_ROOT_ID, 0, {}, 1, {}});
+    nodes.emplace(queries_ino, Node{FUSE_ROOT_ID, 0, {}, 1, {}});
+    nodes.emplace(meta_ino, Node{FUSE_ROOT_ID, 0, {}, 1, {}});
+
+    create_schema(*db.writer());
+
+    /* nothing is mounted yet, so no request waits on the import */
+    scanner.scan();
+    index.load(*db.reader());
+    scanner.watch([this](const Scanner::Change &change) { changed_on_disk(change); });
+}
+
+TagFS::~TagFS() {
+    scanner.stop();
+    close(datadirfd);
+}
+
+auto TagFS::create_schema(SQLite &conn) -> void {
+    conn.exec(R"(
 create table if not exists files
     ( id integer primary key not null
     , path text not null unique
+    , name text not null
     );
 
+create index if not exists files_name on files (name);
+
+-- `TagIndex` keeps file ids in 32 bits: refuse a row it could not hold
+-- before it is committed, rather than after
+create trigger if not exists files_id_range after insert on files
+when new.id not between 0 and 4294967295
+begin
+    select raise(abort, 'file ids ran out');
+end;
+
+-- files by the directory they are in: `path` up to its last `/`, empty at the top
+create index if not exists files_dir on files (rtrim(path, replace(path, '/', '')));
+
 create table if not exists tags
     ( id integer primary key not null
     , name text not null unique
@@ -24,5 +206,1445 @@ create table if not exists files_tags
     , foreign key (file_id) references files (id) on delete cascade
     , foreign key (tag_id) references tags (id) on delete cascade
     );
+
+create index if not exists files_tags_tag on files_tags (tag_id, file_id);
+
+create table if not exists dirs
+    ( path text primary key not null
+    , mtime integer not null
+    ) without rowid;
 )");
 }
+
+auto TagFS::shows_tag(const Node &dir, std::optional<int64_t> tag) -> bool {
+    return tag && dir.query.empty() && !contains(dir.tags, *tag);
+}
+
+auto TagFS::node(fuse_ino_t ino) -> std::optional<Node> {
+    std::lock_guard lock(nodes_mutex);
+    auto it = nodes.find(ino);
+    if (it == nodes.end())
+        return {};
+    return it->second;
+}
+
+/* the directory `tag` inside `parent`, counting one more kernel lookup */
+auto TagFS::intern(fuse_ino_t parent, int64_t tag) -> fuse_ino_t {
+    std::lock_guard lock(nodes_mutex);
+
+    auto child = children.find({parent, tag});
+    if (child != children.end()) {
+        nodes.at(child->second).nlookup++;
+        return child->second;
+    }
+
+    auto tags = nodes.at(parent).tags;
+    tags.insert(std::upper_bound(tags.begin(), tags.end(), tag), tag);
+
+    auto ino = next_node++ << 1;
+    nodes.emplace(ino, Node{parent, tag, std::move(tags), 1, {}});
+    children.emplace(std::pair(parent, tag), ino);
+    return ino;
+}
+
+auto TagFS::intern_query(const std::string &query) -> fuse_ino_t {
+    std::lock_guard lock(nodes_mutex);
+
+    auto it = queries.find(query);
+    if (it != queries.end()) {
+        nodes.at(it->second).nlookup++;
+        return it->second;
+    }
+
+    auto ino = next_node++ << 1;
+    nodes.emplace(ino, Node{queries_ino, 0, {}, 1, query});
+    queries.emplace(query, ino);
+    return ino;
+}
+
+auto TagFS::read_only(fuse_ino_t ino) -> bool {
+    if (ino == queries_ino || ino == meta_ino)
+        return true;
+    std::lock_guard lock(nodes_mutex);
+    auto it = nodes.find(ino);
+    return it != nodes.end() && !it->second.query.empty();
+}
+
+auto TagFS::ref_file(int64_t id) -> void {
+    std::lock_guard lock(nodes_mutex);
+    file_lookups[id]++;
+}
+
+auto TagFS::open_handle(
+    [[maybe_unused]] fuse_req_t req,
+    int64_t id,
+    int fd,
+    struct fuse_file_info *fi
+) -> void {
+    bool writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+    auto handle = new FileHandle{fd, id, 0, writable, {}};
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    /* needs CAP_SYS_ADMIN; failing that, data is spliced through us */
+    if (passthrough) {
+        int backing_id = fuse_passthrough_open(req, fd);
+        if (backing_id > 0) {
+            handle->backing_id = backing_id;
+            fi->backing_id = backing_id;
+        }
+    }
+#endif
+
+    if (writable) {
+        std::lock_guard lock(nodes_mutex);
+        file_writers[id]++;
+    }
+    fi->fh = reinterpret_cast<uint64_t>(handle);
+}
+
+auto TagFS::dir_attr(fuse_ino_t ino, struct stat *sb, bool writable) const noexcept -> void {
+    *sb = datadir_attr;
+    sb->st_ino = ino;
+    sb->st_mode = S_IFDIR | (writable ? 0755 : 0555);
+    sb->st_nlink = 2;
+}
+
+/* its size is unknown until it is read, like files in /proc */
+auto TagFS::stats_attr(struct stat *sb) const noexcept -> void {
+    *sb = datadir_attr;
+    sb->st_ino = stats_ino;
+    sb->st_mode = S_IFREG | 0444;
+    sb->st_nlink = 1;
+    sb->st_size = 0;
+    sb->st_blocks = 0;
+}
+
+auto TagFS::stats_report() -> std::string {
+    std::ostringstream out;
+    Stats::report(out);
+
+    out << "commit.waiting value=" << db.queue_depth() << '\n';
+    out << "sql.idle_readers value=" << db.idle_readers_count() << '\n';
+
+    std::lock_guard lock(nodes_mutex);
+    out << "nodes value=" << nodes.size() << '\n';
+    out << "files.known value=" << file_lookups.size() << '\n';
+    out << "files.writing value=" << file_writers.size() << '\n';
+    return out.str();
+}
+
+auto TagFS::file_attr(SQLite &conn, int64_t id, struct stat *sb) -> int {
+    auto stmt = conn.prepare_bind("select path from files where id = ?", id);
+    auto row = stmt.step();
+    if (!row)
+        return -ENOENT;
+
+    if (fstatat(datadirfd, row->column_text(0).data(), sb, AT_SYMLINK_NOFOLLOW) != 0)
+        return -errno;
+
+    sb->st_ino = file_ino(id);
+    sb->st_nlink = 1;
+    return 0;
+}
+
+auto TagFS::file_tags(SQLite &conn, int64_t id) -> std::vector<int64_t> {
+    std::vector<int64_t> tags;
+    for (auto [tag] : conn.prepare_bind("select tag_id from files_tags where file_id = ? order by tag_id", id)
+                          .rows<int64_t>())
+        tags.push_back(tag);
+    return tags;
+}
+
+auto TagFS::tag_id(SQLite &conn, std::string_view name) -> std::optional<int64_t> {
+    auto stmt = conn.prepare_bind("select id from tags where name = ?", name);
+    if (auto row = stmt.step())
+        return row->column_int64(0);
+    return {};
+}
+
+/*
+ * The file called `name` carrying every tag of `dir`. Files are shown
+ * under the last component of their path; when several share it, the
+ * oldest one wins.
+ *
+ * This asks `files_tags` itself, so it also sees what the current batch
+ * changed when run by a mutation.
+ */
+auto TagFS::file_in(
+    SQLite &conn,
+    const Node &dir,
+    std::string_view name
+) -> std::optional<int64_t> {
+    if (dir.tags.empty()) {
+        auto stmt = conn.prepare_bind("select id from files where name = ? order by id limit 1", name);
+        if (auto row = stmt.step())
+            return row->column_int64(0);
+        return {};
+    }
+
+    auto stmt = conn.prepare_bind(R"(
+select id from files
+where name = ?
+  and (select count(*) from files_tags where file_id = files.id and tag_id in carray(?)) = ?
+order by id limit 1
+)", name, dir.tags, static_cast<int64_t>(dir.tags.size()));
+    if (auto row = stmt.step())
+        return row->column_int64(0);
+    return {};
+}
+
+/* the same, filtered through `index`, which only holds committed tags */
+auto TagFS::indexed_file_in(
+    SQLite &conn,
+    const Node &dir,
+    std::string_view name
+) -> std::optional<int64_t> {
+    auto stmt = conn.prepare_bind("select id from files where name = ? order by id", name);
+    while (auto row = stmt.step()) {
+        auto id = row->column_int64(0);
+        if (index.contains(id, dir.tags))
+            return id;
+    }
+    return {};
+}
+
+auto TagFS::cached_attr(int64_t id, struct stat *sb) -> int {
+    bool writing;
+    {
+        std::lock_guard lock(nodes_mutex);
+        writing = file_writers.count(id);
+    }
+    if (writing)
+        return file_attr(*db.reader(), id, sb);
+
+    if (cache.attr(id, sb))
+        return 0;
+
+    auto gen = cache.generation();
+    int res = file_attr(*db.reader(), id, sb);
+    if (res == 0)
+        cache.put_attr(gen, id, *sb);
+    return res;
+}
+
+auto TagFS::cached_tag_id(std::string_view name) -> std::optional<int64_t> {
+    if (auto tag = cache.tag(name))
+        return *tag;
+
+    auto gen = cache.generation();
+    auto tag = tag_id(*db.reader(), name);
+    cache.put_tag(gen, name, tag);
+    return tag;
+}
+
+auto TagFS::cached_file_in(const Node &dir, std::string_view name) -> std::optional<int64_t> {
+    if (auto file = cache.file(name, dir.tags))
+        return *file;
+
+    auto gen = cache.generation();
+    auto file = indexed_file_in(*db.reader(), dir, name);
+    cache.put_file(gen, name, dir.tags, file);
+    return file;
+}
+
+auto TagFS::cached_plan(const std::string &query) -> Cache::Plan {
+    if (auto plan = cache.plan(query))
+        return plan;
+
+    auto gen = cache.generation();
+    auto parsed = Query::parse(query);
+    if (!parsed)
+        return {};
+    auto plan = std::make_shared<const Query::Plan>(parsed->plan(
+        [&](std::string_view name) { return cached_tag_id(name); }));
+    cache.put_plan(gen, query, plan);
+    return plan;
+}
+
+auto TagFS::files_after(const Node &dir, int64_t after, std::size_t limit) -> std::vector<int64_t> {
+    auto everything = [&](int64_t after, std::size_t limit) {
+        std::vector<int64_t> ids;
+        auto conn = db.reader();
+        for (auto [id] : conn->prepare_bind("select id from files where id > ? order by id limit ?",
+                                            after, static_cast<int64_t>(limit)).rows<int64_t>())
+            ids.push_back(id);
+        return ids;
+    };
+
+    if (!dir.query.empty()) {
+        auto plan = cached_plan(dir.query);
+        if (!plan)
+            return {};
+        return Query::run(*plan, index, everything, after, limit);
+    }
+    if (dir.tags.empty())
+        return everything(after, limit);
+    return index.intersect(dir.tags, after, limit);
+}
+
+/*
+ * Callers update the database and `index` first: a lookup that read the
+ * old state either stores it before this runs, or sees the generation
+ * bumped by it and stores nothing.
+ */
+auto TagFS::changed_file(
+    std::string_view name,
+    const std::vector<int64_t> &tags,
+    bool root
+) -> void {
+    cache.forget_name(name);
+
+    std::lock_guard lock(nodes_mutex);
+    for (auto &&[ino, node] : nodes)
+        if ((root && ino == FUSE_ROOT_ID) || intersects(node.tags, tags) || !node.query.empty())
+            invalidate_entry(ino, std::string(name));
+}
+
+auto TagFS::changed_tag(std::string_view name) -> void {
+    cache.forget_name(name);
+    cache.forget_plans();
+
+    std::lock_guard lock(nodes_mutex);
+    for (auto &&[ino, node] : nodes)
+        invalidate_entry(ino, std::string(name));
+}
+
+auto TagFS::drop_files(
+    SQLite &conn,
+    std::vector<std::pair<int64_t, std::string>> files
+) -> std::function<void()> {
+    std::vector<std::vector<int64_t>> tags;
+    for (auto &&[id, name] : files) {
+        tags.push_back(file_tags(conn, id));
+        conn.prepare_bind("delete from files where id = ?", id).exec();
+    }
+
+    return [this, files = std::move(files), tags = std::move(tags)] {
+        for (std::size_t i = 0; i < files.size(); i++) {
+            index.remove(files[i].first, tags[i]);
+            cache.forget_attr(files[i].first);
+            changed_file(files[i].second, tags[i], true);
+        }
+    };
+}
+
+/*
+ * Changes made through the mount come back here too; applying them again
+ * finds nothing left to do.
+ */
+auto TagFS::changed_on_disk(const Scanner::Change &change) -> void {
+    auto name = [](const std::string &path) {
+        return std::filesystem::path(path).filename().string();
+    };
+    auto files_at = [](SQLite &conn, const std::string &path, bool dir) {
+        std::vector<std::pair<int64_t, std::string>> files;
+        auto stmt = dir
+            ? conn.prepare_bind("select id, name from files where path > ? and path < ?",
+                                path + "/", path + "0")
+            : conn.prepare_bind("select id, name from files where path = ?", path);
+        for (auto [id, name] : stmt.rows<int64_t, std::string_view>())
+            files.emplace_back(id, name);
+        return files;
+    };
+
+    switch (change.kind) {
+    case Scanner::Change::Created:
+        db.commit([&](SQLite &conn) -> std::function<void()> {
+            /* known to exist, but never listed by a scan */
+            if (change.dir) {
+                conn.prepare_bind("insert or ignore into dirs (path, mtime) values (?, 0)",
+                                  change.path).exec();
+                return {};
+            }
+            conn.prepare_bind("insert or ignore into files (path, name) values (?, ?)",
+                              change.path, name(change.path)).exec();
+            if (!sqlite3_changes(conn.db))
+                return {};
+            return [&] { changed_file(name(change.path), {}, true); };
+        });
+        break;
+
+    case Scanner::Change::Deleted:
+        db.commit([&](SQLite &conn) -> std::function<void()> {
+            if (change.dir)
+                conn.prepare_bind("delete from dirs where path = ? or (path > ? and path < ?)",
+                                  change.path, change.path + "/", change.path + "0").exec();
+            return drop_files(conn, files_at(conn, change.path, change.dir));
+        });
+        break;
+
+    case Scanner::Change::Moved:
+        db.commit([&](SQLite &conn) -> std::function<void()> {
+            if (change.dir) {
+                auto from = change.path, to = change.newpath;
+                auto suffix = static_cast<int64_t>(from.size() + 1);
+                conn.prepare_bind(
+                    "update files set path = ? || substr(path, ?) where path > ? and path < ?",
+                    to, suffix, from + "/", from + "0").exec();
+                conn.prepare_bind(
+                    "update dirs set path = ? || substr(path, ?) where path = ? or (path > ? and path < ?)",
+                    to, suffix, from, from + "/", from + "0").exec();
+                return {};
+            }
+
+            auto moved = files_at(conn, change.path, false);
+            if (moved.empty()) {
+                conn.prepare_bind("insert or ignore into files (path, name) values (?, ?)",
+                                  change.newpath, name(change.newpath)).exec();
+                if (!sqlite3_changes(conn.db))
+                    return {};
+                return [&] { changed_file(name(change.newpath), {}, true); };
+            }
+
+            /* whatever the move replaced is gone */
+            auto replaced = drop_files(conn, files_at(conn, change.newpath, false));
+
+            auto id = moved.front().first;
+            auto tags = file_tags(conn, id);
+            conn.prepare_bind("update files set path = ?, name = ? where id = ?",
+                              change.newpath, name(change.newpath), id).exec();
+            return [&, replaced, id, tags] {
+                replaced();
+                cache.forget_attr(id);
+                changed_file(name(change.path), tags, true);
+                changed_file(name(change.newpath), tags, true);
+            };
+        });
+        break;
+
+    case Scanner::Change::Modified: {
+        std::optional<int64_t> id;
+        {
+            auto conn = db.reader();
+            auto stmt = conn->prepare_bind("select id from files where path = ?", change.path);
+            if (auto row = stmt.step())
+                id = row->column_int64(0);
+        }
+        if (id) {
+            cache.forget_attr(*id);
+            invalidate_inode(file_ino(*id));
+        }
+        break;
+    }
+
+    /*
+     * Events were lost: rescan, then reload everything derived from the
+     * database in order with the writes around it. Kernel entries expire
+     * with `kernel_timeout`.
+     */
+    case Scanner::Change::Overflow:
+        scanner.scan();
+        db.commit([&](SQLite &) -> std::function<void()> {
+            return [&] {
+                index.load(*db.reader());
+                cache.clear();
+            };
+        });
+        break;
+    }
+}
+
+auto TagFS::init(struct fuse_conn_info *conn) -> void {
+    conn->want |= conn->capable
+        & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    /* let the kernel choose when a listing is worth returning attributes */
+    conn->want |= conn->capable & (FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+        passthrough = true;
+    }
+#endif
+}
+
+auto TagFS::lookup(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    struct fuse_entry_param *e
+) -> int {
+    auto dir = node(parent);
+    if (!dir)
+        return -ESTALE;
+
+    if (parent == FUSE_ROOT_ID && name == queries_name) {
+        e->ino = queries_ino;
+        dir_attr(e->ino, &e->attr, false);
+        return 0;
+    }
+    if (parent == FUSE_ROOT_ID && name == meta_name) {
+        e->ino = meta_ino;
+        dir_attr(e->ino, &e->attr, false);
+        return 0;
+    }
+    if (parent == meta_ino) {
+        if (name != stats_name)
+            return -ENOENT;
+        e->ino = stats_ino;
+        stats_attr(&e->attr);
+        return 0;
+    }
+    if (parent == queries_ino) {
+        if (!cached_plan(name))
+            return -ENOENT;
+        e->ino = intern_query(name);
+        dir_attr(e->ino, &e->attr, false);
+        return 0;
+    }
+    if (!dir->query.empty()) {
+        auto plan = cached_plan(dir->query);
+        std::optional<int64_t> id;
+        {
+            auto conn = db.reader();
+            auto stmt = conn->prepare_bind("select id from files where name = ? order by id", name);
+            while (auto row = stmt.step()) {
+                if (Query::matches(*plan, index, row->column_int64(0))) {
+                    id = row->column_int64(0);
+                    break;
+                }
+            }
+        }
+        if (!id)
+            return -ENOENT;
+        if (int res = cached_attr(*id, &e->attr); res < 0)
+            return res;
+        e->ino = file_ino(*id);
+        ref_file(*id);
+        return 0;
+    }
+
+    if (auto tag = cached_tag_id(name); shows_tag(*dir, tag)) {
+        e->ino = intern(parent, *tag);
+        dir_attr(e->ino, &e->attr);
+        return 0;
+    }
+
+    if (auto id = cached_file_in(*dir, name)) {
+        if (int res = cached_attr(*id, &e->attr); res < 0)
+            return res;
+        e->ino = file_ino(*id);
+        ref_file(*id);
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+auto TagFS::forget(fuse_ino_t ino, uint64_t nlookup) -> void {
+    std::lock_guard lock(nodes_mutex);
+
+    if (is_file(ino)) {
+        auto it = file_lookups.find(file_id(ino));
+        if (it == file_lookups.end())
+            return;
+        if (it->second <= nlookup)
+            file_lookups.erase(it);
+        else
+            it->second -= nlookup;
+        return;
+    }
+
+    auto it = nodes.find(ino);
+    if (ino == FUSE_ROOT_ID || ino == queries_ino || ino == meta_ino || it == nodes.end())
+        return;
+    if (it->second.nlookup > nlookup) {
+        it->second.nlookup -= nlookup;
+        return;
+    }
+    if (it->second.query.empty())
+        children.erase({it->second.parent, it->second.tag});
+    else
+        queries.erase(it->second.query);
+    nodes.erase(it);
+}
+
+auto TagFS::getattr(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t ino,
+    struct stat *sb,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    if (ino == stats_ino) {
+        stats_attr(sb);
+        return 0;
+    }
+    if (is_file(ino))
+        return cached_attr(file_id(ino), sb);
+
+    if (!node(ino))
+        return -ESTALE;
+    dir_attr(ino, sb, !read_only(ino));
+    return 0;
+}
+
+auto TagFS::setattr(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t ino,
+    struct stat *attr,
+    int to_set,
+    struct stat *out,
+    struct fuse_file_info *fi
+) -> int {
+    if (!is_file(ino))
+        return -EPERM;
+    if (ino == stats_ino)
+        return -EROFS;
+
+    auto id = file_id(ino);
+    std::string path;
+    {
+        auto conn = db.reader();
+        auto stmt = conn->prepare_bind("select path from files where id = ?", id);
+        auto row = stmt.step();
+        if (!row)
+            return -ENOENT;
+        path = row->column_text(0);
+    }
+
+    int fd = fi ? reinterpret_cast<FileHandle *>(fi->fh)->fd : -1;
+    int res = 0;
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        res = fd >= 0 ? fchmod(fd, attr->st_mode)
+                      : fchmodat(datadirfd, path.c_str(), attr->st_mode, 0);
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : uid_t(-1);
+        gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : gid_t(-1);
+        res = fd >= 0 ? fchown(fd, uid, gid)
+                      : fchownat(datadirfd, path.c_str(), uid, gid, AT_SYMLINK_NOFOLLOW);
+    }
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (fd >= 0) {
+            res = ftruncate(fd, attr->st_size);
+        } else {
+            int tfd = openat(datadirfd, path.c_str(), O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+            res = tfd < 0 ? -1 : ftruncate(tfd, attr->st_size);
+            if (tfd >= 0) {
+                int saved = errno;
+                close(tfd);
+                errno = saved;
+            }
+        }
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            times[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+            times[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            times[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+            times[1] = attr->st_mtim;
+        res = fd >= 0 ? futimens(fd, times)
+                      : utimensat(datadirfd, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    cache.forget_attr(id);
+    if (res != 0)
+        return -errno;
+    return file_attr(*db.reader(), id, out);
+}
+
+/* `mkdir` creates the tag; it then shows up in every directory */
+auto TagFS::mkdir(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    [[maybe_unused]] mode_t mode,
+    struct fuse_entry_param *e
+) -> int {
+    auto dir = node(parent);
+    if (!dir)
+        return -ESTALE;
+    if (read_only(parent))
+        return -EROFS;
+    /* tags show up in the root too */
+    if (reserved(name))
+        return -EEXIST;
+
+    int res = 0;
+    int64_t tag;
+    db.commit([&](SQLite &conn) -> std::function<void()> {
+        if (tag_id(conn, name) || file_named(conn, name)) {
+            res = -EEXIST;
+            return {};
+        }
+        conn.prepare_bind("insert into tags (name) values (?)", name).exec();
+        tag = sqlite3_last_insert_rowid(conn.db);
+        return [&] { changed_tag(name); };
+    });
+    if (res < 0)
+        return res;
+
+    e->ino = intern(parent, tag);
+    dir_attr(e->ino, &e->attr);
+    return 0;
+}
+
+/*
+ * Unlinking a file from a tag directory removes that directory's tag
+ * from it; unlinking it from the root deletes the file itself.
+ */
+auto TagFS::unlink(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name
+) -> int {
+    auto dir = node(parent);
+    if (!dir)
+        return -ESTALE;
+    if (read_only(parent))
+        return -EROFS;
+
+    int res = 0;
+    bool unlinked = false;
+    commit_on_disk(db, unlinked, [&](SQLite &conn) -> std::function<void()> {
+        auto id = file_in(conn, *dir, name);
+        if (!id) {
+            res = -ENOENT;
+            return {};
+        }
+
+        if (dir->tag) {
+            conn.prepare_bind("delete from files_tags where file_id = ? and tag_id = ?",
+                              *id, dir->tag).exec();
+            return [&, id = *id] {
+                index.remove(id, dir->tag);
+                changed_file(name, {dir->tag}, false);
+            };
+        }
+
+        /* the backing file goes first: a stale row is harmless, a lost file is not */
+        auto stmt = conn.prepare_bind("select path from files where id = ?", *id);
+        if (::unlinkat(datadirfd, stmt.step()->column_text(0).data(), 0) != 0 && errno != ENOENT) {
+            res = -errno;
+            return {};
+        }
+        unlinked = true;
+        auto tags = file_tags(conn, *id);
+        conn.prepare_bind("delete from files where id = ?", *id).exec();
+        return [&, id = *id, tags = std::move(tags)] {
+            index.remove(id, tags);
+            cache.forget_attr(id);
+            changed_file(name, tags, true);
+        };
+    });
+    return res;
+}
+
+/* `rmdir` deletes the tag, as long as no file carries it anymore */
+auto TagFS::rmdir(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name
+) -> int {
+    auto dir = node(parent);
+    if (!dir)
+        return -ESTALE;
+    if (read_only(parent))
+        return -EROFS;
+
+    int res = 0;
+    db.commit([&](SQLite &conn) -> std::function<void()> {
+        auto tag = tag_id(conn, name);
+        if (!shows_tag(*dir, tag)) {
+            res = -ENOENT;
+            return {};
+        }
+        if (conn.prepare_bind("select 1 from files_tags where tag_id = ? limit 1", *tag).step()) {
+            res = -ENOTEMPTY;
+            return {};
+        }
+
+        conn.prepare_bind("delete from tags where id = ?", *tag).exec();
+        return [&, tag = *tag] {
+            index.remove_tag(tag);
+            changed_tag(name);
+        };
+    });
+    return res;
+}
+
+/*
+ * Moving a file between directories swaps the tags of the old path for
+ * the ones of the new path; changing its name renames the backing file.
+ * Renaming a directory renames the tag.
+ *
+ * A file already under the new name is replaced the way `unlink` would
+ * remove it: dropped from a tag directory, deleted in the root. When its
+ * backing file is the one overwritten, it is deleted wherever it is and
+ * its tags carry over, so that saving through a temporary file, as
+ * editors do, keeps them.
+ */
+auto TagFS::rename(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    fuse_ino_t newparent,
+    const char *newname,
+    unsigned int flags
+) -> int {
+    if (flags & ~RENAME_NOREPLACE)
+        return -EINVAL;
+    bool noreplace = flags & RENAME_NOREPLACE;
+
+    auto olddir = node(parent);
+    auto newdir = node(newparent);
+    if (!olddir || !newdir)
+        return -ESTALE;
+    if (read_only(parent) || read_only(newparent))
+        return -EROFS;
+
+    int res = 0;
+    bool replaced_on_disk = false;
+    commit_on_disk(db, replaced_on_disk, [&](SQLite &conn) -> std::function<void()> {
+        if (auto tag = tag_id(conn, name); shows_tag(*olddir, tag)) {
+            if (parent != newparent) {
+                res = -EINVAL;
+                return {};
+            }
+
+            /* tags show up in the root too */
+            if (reserved(newname)) {
+                res = -EEXIST;
+                return {};
+            }
+
+            /* an empty tag can be replaced, as an empty directory would be */
+            auto replaced = tag_id(conn, newname);
+            if (replaced == tag)
+                return {};
+            if (noreplace && (replaced || file_named(conn, newname)))
+                res = -EEXIST;
+            else if (replaced && contains(newdir->tags, *replaced))
+                res = -EINVAL;
+            else if (replaced && conn.prepare_bind("select 1 from files_tags where tag_id = ? limit 1", *replaced).step())
+                res = -ENOTEMPTY;
+            else if (!replaced && file_in(conn, *newdir, newname))
+                res = -ENOTDIR;
+            else if (!replaced && file_named(conn, newname))
+                res = -EEXIST;
+            if (res < 0)
+                return {};
+
+            if (replaced)
+                conn.prepare_bind("delete from tags where id = ?", *replaced).exec();
+            conn.prepare_bind("update tags set name = ? where id = ?", newname, *tag).exec();
+            return [&, replaced] {
+                if (replaced)
+                    index.remove_tag(*replaced);
+                changed_tag(name);
+                changed_tag(newname);
+            };
+        }
+
+        auto id = file_in(conn, *olddir, name);
+        if (!id) {
+            res = -ENOENT;
+            return {};
+        }
+        if (newparent == FUSE_ROOT_ID && reserved(newname)) {
+            res = -EEXIST;
+            return {};
+        }
+        if (tag_id(conn, newname)) {
+            res = noreplace ? -EEXIST : -EISDIR;
+            return {};
+        }
+        auto other = file_in(conn, *newdir, newname);
+        if (other == id)
+            other.reset();
+        if (other && noreplace) {
+            res = -EEXIST;
+            return {};
+        }
+
+        auto path_of = [&](int64_t id) {
+            return std::filesystem::path(std::string(
+                conn.prepare_bind("select path from files where id = ?", id).step()->column_text(0)));
+        };
+        bool renamed = std::string_view(name) != newname;
+        auto path = path_of(*id);
+        auto newpath = renamed ? path.parent_path() / newname : path;
+        auto otherpath = other ? path_of(*other) : std::filesystem::path();
+        bool overwritten = other && renamed && otherpath == newpath;
+
+        if (renamed) {
+            if (::renameat2(datadirfd, path.c_str(), datadirfd, newpath.c_str(),
+                            overwritten ? 0 : RENAME_NOREPLACE) != 0) {
+                res = -errno;
+                return {};
+            }
+        }
+        if (other && !overwritten && !newdir->tag) {
+            if (::unlinkat(datadirfd, otherpath.c_str(), 0) != 0 && errno != ENOENT) {
+                res = -errno;
+                if (renamed)
+                    ::renameat2(datadirfd, newpath.c_str(), datadirfd, path.c_str(), RENAME_NOREPLACE);
+                return {};
+            }
+        }
+
+        /* once a replaced backing file is gone, this stands; a plain rename is undone */
+        if (overwritten || (other && !newdir->tag)) {
+            replaced_on_disk = true;
+        } else if (renamed) {
+            db.on_rollback([this, path, newpath] {
+                ::renameat2(datadirfd, newpath.c_str(), datadirfd, path.c_str(), RENAME_NOREPLACE);
+            });
+        }
+
+        std::function<void()> replaced;
+        std::vector<int64_t> inherited;
+        if (other && (overwritten || !newdir->tag)) {
+            if (overwritten)
+                inherited = file_tags(conn, *other);
+            replaced = drop_files(conn, {{*other, newname}});
+        } else if (other) {
+            conn.prepare_bind("delete from files_tags where file_id = ? and tag_id = ?",
+                              *other, newdir->tag).exec();
+            replaced = [&, other = *other] {
+                index.remove(other, newdir->tag);
+                changed_file(newname, {newdir->tag}, false);
+            };
+        }
+
+        if (renamed) {
+            conn.prepare_bind("update files set path = ?, name = ? where id = ?",
+                              newpath.native(), newname, *id).exec();
+        }
+
+        auto removed = difference(olddir->tags, newdir->tags);
+        if (!removed.empty()) {
+            conn.prepare_bind(
+                "delete from files_tags where file_id = ? and tag_id in carray(?)",
+                *id, removed).exec();
+        }
+        auto added = merge(difference(newdir->tags, olddir->tags), inherited);
+        if (!added.empty()) {
+            conn.prepare_bind(
+                "insert or ignore into files_tags (file_id, tag_id) select ?, value from carray(?)",
+                *id, added).exec();
+        }
+        auto tags = renamed ? file_tags(conn, *id) : std::vector<int64_t>();
+
+        return [&, id = *id, renamed, removed, added, tags, replaced] {
+            if (replaced)
+                replaced();
+            index.remove(id, removed);
+            index.add(id, added);
+            if (renamed) {
+                changed_file(name, merge(tags, removed), true);
+                changed_file(newname, tags, true);
+            } else {
+                changed_file(name, merge(removed, added), false);
+            }
+        };
+    });
+    return res;
+}
+
+/* linking a file into a directory adds that directory's tags to it */
+auto TagFS::link(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t ino,
+    fuse_ino_t newparent,
+    const char *newname,
+    struct fuse_entry_param *e
+) -> int {
+    if (!is_file(ino) || ino == stats_ino)
+        return -EPERM;
+
+    auto dir = node(newparent);
+    if (!dir)
+        return -ESTALE;
+    if (read_only(newparent))
+        return -EROFS;
+
+    auto id = file_id(ino);
+    int res = 0;
+    db.commit([&](SQLite &conn) -> std::function<void()> {
+        auto stmt = conn.prepare_bind("select name from files where id = ?", id);
+        auto row = stmt.step();
+        if (!row) {
+            res = -ENOENT;
+            return {};
+        }
+        if (row->column_text(0) != newname) {
+            res = -EINVAL;
+            return {};
+        }
+        if (auto other = file_in(conn, *dir, newname); other && *other != id) {
+            res = -EEXIST;
+            return {};
+        }
+
+        if (!dir->tags.empty()) {
+            conn.prepare_bind(
+                "insert or ignore into files_tags (file_id, tag_id) select ?, value from carray(?)",
+                id, dir->tags).exec();
+        }
+        res = file_attr(conn, id, &e->attr);
+        return [&] {
+            index.add(id, dir->tags);
+            changed_file(newname, dir->tags, false);
+        };
+    });
+    if (res < 0)
+        return res;
+
+    e->ino = ino;
+    ref_file(id);
+    return 0;
+}
+
+auto TagFS::open(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *fi
+) -> int {
+    if (!is_file(ino))
+        return -EISDIR;
+    /* a snapshot taken now, read through the page cache bypassed */
+    if (ino == stats_ino) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EROFS;
+        fi->fh = reinterpret_cast<uint64_t>(new FileHandle{-1, 0, 0, false, stats_report()});
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    auto id = file_id(ino);
+    std::string path;
+    {
+        auto conn = db.reader();
+        auto stmt = conn->prepare_bind("select path from files where id = ?", id);
+        auto row = stmt.step();
+        if (!row)
+            return -ENOENT;
+        path = row->column_text(0);
+    }
+
+    int fd = openat(datadirfd, path.c_str(), (fi->flags & ~O_NOFOLLOW) | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    if (fi->flags & O_TRUNC)
+        cache.forget_attr(id);
+    open_handle(req, id, fd, fi);
+    return 0;
+}
+
+/*
+ * Data never goes through a user space buffer: the reply points at the
+ * backing file and libfuse splices it into the device when it can.
+ */
+auto TagFS::read(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    [[maybe_unused]] size_t size,
+    off_t off,
+    struct fuse_file_info *fi,
+    struct fuse_bufvec *buf
+) -> int {
+    auto handle = reinterpret_cast<FileHandle *>(fi->fh);
+    if (handle->fd < 0) {
+        auto &content = handle->content;
+        auto start = std::min(static_cast<size_t>(off), content.size());
+        buf->buf[0].mem = content.data() + start;
+        buf->buf[0].size = std::min(size, content.size() - start);
+        return 0;
+    }
+
+    buf->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf->buf[0].fd = handle->fd;
+    buf->buf[0].pos = off;
+    return 0;
+}
+
+auto TagFS::write_buf(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    struct fuse_bufvec *buf,
+    off_t off,
+    struct fuse_file_info *fi
+) -> ssize_t {
+    auto handle = reinterpret_cast<FileHandle *>(fi->fh);
+
+    struct fuse_bufvec dst{};
+    dst.count = 1;
+    dst.buf[0].size = fuse_buf_size(buf);
+    dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    dst.buf[0].fd = handle->fd;
+    dst.buf[0].pos = off;
+
+    /* no attributes to forget: they are not cached while the file is open for writing */
+    return fuse_buf_copy(&dst, buf, fuse_buf_copy_flags(0));
+}
+
+/* called on every close(2) of a descriptor, which may be a dup */
+auto TagFS::flush(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    struct fuse_file_info *fi
+) -> int {
+    int fd = reinterpret_cast<FileHandle *>(fi->fh)->fd;
+    if (fd >= 0 && close(dup(fd)) != 0)
+        return -errno;
+    return 0;
+}
+
+auto TagFS::release(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    struct fuse_file_info *fi
+) -> int {
+    std::unique_ptr<FileHandle> handle(reinterpret_cast<FileHandle *>(fi->fh));
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (handle->backing_id)
+        fuse_passthrough_close(req, handle->backing_id);
+#endif
+
+    if (handle->writable) {
+        {
+            std::lock_guard lock(nodes_mutex);
+            auto it = file_writers.find(handle->id);
+            if (it != file_writers.end() && --it->second == 0)
+                file_writers.erase(it);
+        }
+        cache.forget_attr(handle->id);
+    }
+
+    if (handle->fd >= 0)
+        close(handle->fd);
+    return 0;
+}
+
+auto TagFS::fsync(
+    [[maybe_unused]] fuse_req_t req,
+    [[maybe_unused]] fuse_ino_t ino,
+    int datasync,
+    struct fuse_file_info *fi
+) -> int {
+    int fd = reinterpret_cast<FileHandle *>(fi->fh)->fd;
+    if (fd >= 0 && (datasync ? fdatasync(fd) : ::fsync(fd)) != 0)
+        return -errno;
+    return 0;
+}
+
+auto TagFS::opendir(
+    [[maybe_unused]] fuse_req_t req,
+    fuse_ino_t ino,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> int {
+    if (is_file(ino))
+        return -ENOTDIR;
+    if (!node(ino))
+        return -ESTALE;
+    return 0;
+}
+
+auto TagFS::readdir(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    char *buf,
+    size_t size,
+    off_t off,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> ssize_t {
+    return list(req, ino, buf, size, off, false);
+}
+
+auto TagFS::readdirplus(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    char *buf,
+    size_t size,
+    off_t off,
+    [[maybe_unused]] struct fuse_file_info *fi
+) -> ssize_t {
+    return list(req, ino, buf, size, off, true);
+}
+
+/*
+ * A directory lists `.`, `..`, `q` and `.yatagfs` at the root, then
+ * every tag not on its path, then its files; `/q` lists nothing, a query
+ * only files and `/.yatagfs` only `stats`.
+ */
+auto TagFS::list(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    char *buf,
+    size_t size,
+    off_t off,
+    bool plus
+) -> ssize_t {
+    auto dir = node(ino);
+    if (!dir)
+        return -ESTALE;
+
+    auto part = static_cast<Part>(off >> part_shift);
+    int64_t after = off & ((off_t(1) << part_shift) - 1);
+    size_t used = 0;
+
+    /* read no more than the shortest names could fill `buf` with */
+    auto shortest = plus ? fuse_add_direntry_plus(req, nullptr, 0, "x", nullptr, 0)
+                         : fuse_add_direntry(req, nullptr, 0, "x", nullptr, 0);
+    auto page = std::clamp<std::size_t>(size / shortest, 1, max_page);
+
+    /*
+     * False once `buf` is full. For readdirplus, `lookup` fills in the
+     * entry and counts a kernel lookup, so it only runs for entries that
+     * fit; an entry it fails on went away meanwhile and is left out.
+     */
+    using Lookup = std::function<int(struct fuse_entry_param *)>;
+    auto add = [&](const std::string &name, fuse_ino_t d_ino, mode_t mode, Part in, int64_t id,
+                   const Lookup &lookup) -> bool {
+        auto len = plus ? fuse_add_direntry_plus(req, nullptr, 0, name.c_str(), nullptr, 0)
+                        : fuse_add_direntry(req, nullptr, 0, name.c_str(), nullptr, 0);
+        if (len > size - used)
+            return false;
+
+        if (plus) {
+            struct fuse_entry_param e;
+            entry_param(&e);
+            e.attr.st_ino = d_ino;
+            e.attr.st_mode = mode;
+            if (lookup && lookup(&e) < 0)
+                return true;
+            fuse_add_direntry_plus(req, buf + used, size - used, name.c_str(), &e, cursor(in, id));
+        } else {
+            struct stat sb{};
+            sb.st_ino = d_ino;
+            sb.st_mode = mode;
+            fuse_add_direntry(req, buf + used, size - used, name.c_str(), &sb, cursor(in, id));
+        }
+        used += len;
+        return true;
+    };
+
+    if (part == dot_part) {
+        std::vector<std::pair<std::string, fuse_ino_t>> dots{{".", ino}, {"..", dir->parent}};
+        if (ino == FUSE_ROOT_ID) {
+            dots.emplace_back(queries_name, queries_ino);
+            dots.emplace_back(meta_name, meta_ino);
+        }
+        if (ino == meta_ino)
+            dots.emplace_back(stats_name, stats_ino);
+
+        for (auto i = static_cast<std::size_t>(after); i < dots.size(); i++) {
+            auto &[name, d_ino] = dots[i];
+            bool stats = d_ino == stats_ino;
+            /* the kernel does not look up `.` and `..`, and the others are never forgotten */
+            Lookup lookup;
+            if (i >= 2)
+                lookup = [&, d_ino = d_ino](struct fuse_entry_param *e) {
+                    e->ino = d_ino;
+                    if (stats)
+                        stats_attr(&e->attr);
+                    else
+                        dir_attr(d_ino, &e->attr, false);
+                    return 0;
+                };
+            if (!add(name, d_ino, stats ? S_IFREG : S_IFDIR, dot_part, i + 1, lookup))
+                return used;
+        }
+
+        part = ino == queries_ino || ino == meta_ino ? end_part
+             : dir->query.empty() ? tag_part : file_part;
+        after = 0;
+    }
+
+    if (part == tag_part) {
+        for (bool more = true; more;) {
+            std::vector<std::pair<int64_t, std::string>> tags;
+            {
+                auto conn = db.reader();
+                tags.reserve(page);
+                for (auto [id, name] : conn->prepare_bind("select id, name from tags where id > ? order by id limit ?",
+                                                          after, static_cast<int64_t>(page))
+                                           .rows<int64_t, std::string_view>())
+                    tags.emplace_back(id, name);
+            }
+            more = tags.size() == page;
+
+            for (auto &[id, name] : tags) {
+                if (contains(dir->tags, id) || (ino == FUSE_ROOT_ID && reserved(name)))
+                    continue;
+                auto lookup = [&, id = id](struct fuse_entry_param *e) {
+                    e->ino = intern(ino, id);
+                    dir_attr(e->ino, &e->attr);
+                    return 0;
+                };
+                if (!add(name, unknown_ino, S_IFDIR, tag_part, id, lookup))
+                    return used;
+            }
+            if (!tags.empty())
+                after = tags.back().first;
+        }
+
+        part = file_part;
+        after = 0;
+    }
+
+    if (part == file_part) {
+        auto plan = dir->query.empty() ? nullptr : cached_plan(dir->query);
+        auto listed = [&](int64_t id) {
+            return plan ? Query::matches(*plan, index, id) : index.contains(id, dir->tags);
+        };
+
+        for (bool more = true; more;) {
+            auto ids = files_after(*dir, after, page);
+            more = ids.size() == page;
+            if (ids.empty())
+                break;
+            after = ids.back();
+
+            /*
+             * Only the file `lookup` finds is shown under a name: none
+             * where a reserved name or a tag comes first, else the oldest
+             * one listed here. So not when the same name came earlier in
+             * this page, nor when an older file of that name is listed,
+             * which the walk stops at (at once in the root).
+             */
+            std::vector<std::pair<int64_t, std::string>> files;
+            {
+                auto conn = db.reader();
+                std::unordered_map<std::string, int64_t> tags;
+                if (dir->query.empty()) {
+                    for (auto [id, name] : conn->prepare_bind(R"(
+select id, name from tags where name in (select name from files where id in carray(?))
+)", ids).rows<int64_t, std::string_view>())
+                        tags.emplace(name, id);
+                }
+
+                files.reserve(ids.size());
+                std::unordered_set<std::string> seen;
+                for (auto [id, name] : conn->prepare_bind("select id, name from files where id in carray(?) order by id",
+                                                          ids).rows<int64_t, std::string_view>()) {
+                    if (!seen.emplace(name).second)
+                        continue;
+                    if (ino == FUSE_ROOT_ID && reserved(name))
+                        continue;
+                    if (auto tag = tags.find(std::string(name)); tag != tags.end() && shows_tag(*dir, tag->second))
+                        continue;
+                    bool hidden = false;
+                    for (auto [older] : conn->prepare_bind("select id from files where name = ? and id < ? order by id",
+                                                           name, id).rows<int64_t>()) {
+                        if ((hidden = listed(older)))
+                            break;
+                    }
+                    if (!hidden)
+                        files.emplace_back(id, name);
+                }
+            }
+
+            for (auto &[id, name] : files) {
+                auto lookup = [&, id = id](struct fuse_entry_param *e) {
+                    if (int res = cached_attr(id, &e->attr); res < 0)
+                        return res;
+                    e->ino = file_ino(id);
+                    ref_file(id);
+                    return 0;
+                };
+                if (!add(name, file_ino(id), S_IFREG, file_part, id, lookup))
+                    return used;
+            }
+        }
+    }
+
+    return used;
+}
+
+/*
+ * New files are created at the top of the data directory and carry the
+ * tags of the directory they were created in.
+ */
+auto TagFS::create(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char *name,
+    mode_t mode,
+    struct fuse_entry_param *e,
+    struct fuse_file_info *fi
+) -> int {
+    auto dir = node(parent);
+    if (!dir)
+        return -ESTALE;
+    if (read_only(parent))
+        return -EROFS;
+    if (parent == FUSE_ROOT_ID && reserved(name))
+        return -EEXIST;
+
+    int res = 0;
+    int fd = -1;
+    int64_t id;
+    try {
+        db.commit([&](SQLite &conn) -> std::function<void()> {
+            if (tag_id(conn, name) || file_in(conn, *dir, name)) {
+                res = -EEXIST;
+                return {};
+            }
+
+            fd = openat(datadirfd, name, (fi->flags & ~O_NOFOLLOW) | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+            if (fd < 0) {
+                res = -errno;
+                return {};
+            }
+            /* new and empty, so nothing is lost taking it back */
+            db.on_rollback([this, name = std::string(name)] { ::unlinkat(datadirfd, name.c_str(), 0); });
+
+            /* a row left behind by a backing file deleted outside the mount */
+            std::optional<int64_t> stale;
+            std::vector<int64_t> stale_tags;
+            auto stmt = conn.prepare_bind("select id from files where path = ?", name);
+            if (auto row = stmt.step()) {
+                stale = row->column_int64(0);
+                stale_tags = file_tags(conn, *stale);
+                conn.prepare_bind("delete from files where id = ?", *stale).exec();
+            }
+
+            conn.prepare_bind("insert into files (path, name) values (?, ?)", name, name).exec();
+            id = sqlite3_last_insert_rowid(conn.db);
+            if (!dir->tags.empty()) {
+                conn.prepare_bind(
+                    "insert into files_tags (file_id, tag_id) select ?, value from carray(?)",
+                    id, dir->tags).exec();
+            }
+
+            return [&, stale, stale_tags] {
+                if (stale) {
+                    index.remove(*stale, stale_tags);
+                    cache.forget_attr(*stale);
+                    changed_file(name, stale_tags, true);
+                }
+                index.add(id, dir->tags);
+                cache.forget_attr(id);
+                changed_file(name, dir->tags, true);
+            };
+        });
+    } catch (...) {
+        if (fd >= 0)
+            close(fd);
+        throw;
+    }
+    if (res < 0)
+        return res;
+
+    if (fstat(fd, &e->attr) != 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    e->attr.st_ino = file_ino(id);
+    e->attr.st_nlink = 1;
+    e->ino = e->attr.st_ino;
+    ref_file(id);
+
+    open_handle(req, id, fd, fi);
+    return 0;
+}
@@ -1,12 +1,155 @@
+#pragma once
+
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
 
-#include "fuse.hxx"
+#include "cache.hxx"
+#include "fuse_lowlevel.hxx"
+#include "index.hxx"
+#include "scan.hxx"
 #include "sqlite.hxx"
+#include "stats.hxx"
+
+/*
+ * Inode numbers: the root is `FUSE_ROOT_ID`, a file is `files.id << 1 | 1`
+ * and a directory is an even number naming an entry of `nodes`. A tag
+ * directory lists the files carrying every tag on its path, so the same
+ * `tags.id` reached through different parents is a different directory;
+ * nodes are therefore interned by (parent inode, `tags.id`).
+ *
+ * `/q` is reserved: each directory in it is a `Query` listing the files
+ * it selects, read-only like `/q` itself.
+ *
+ * So is `/.yatagfs`, holding the read-only file `stats`: the counters and
+ * latency histograms of `Stats`, plus gauges sampled when it is opened.
+ */
+class TagFS : public FuseLowlevel {
+    struct Node {
+        fuse_ino_t parent;
+        /* tag added by this directory, 0 for the root */
+        int64_t tag;
+        /* every tag on the path, sorted */
+        std::vector<int64_t> tags;
+        uint64_t nlookup;
+        /* what a directory under `/q` lists, empty for every other one */
+        std::string query;
+    };
+
+    struct FileHandle;
 
-class TagFS : public Fuse {
-    SQLite db;
+    SQLite::Pool db;
+    TagIndex index;
+    Cache cache;
     int datadirfd;
+    struct stat datadir_attr;
+
+    std::mutex nodes_mutex;
+    std::unordered_map<fuse_ino_t, Node> nodes;
+    std::map<std::pair<fuse_ino_t, int64_t>, fuse_ino_t> children;
+    std::map<std::string, fuse_ino_t> queries;
+    /* node 1 is `/q`, node 2 `/.yatagfs` */
+    fuse_ino_t next_node = 3;
+    /* kernel lookup count of every file inode it currently knows */
+    std::unordered_map<int64_t, uint64_t> file_lookups;
+    /* open file handles that may write, per file; their attributes are not cached */
+    std::unordered_map<int64_t, unsigned> file_writers;
+
+    /* whether the kernel accepted to read and write backing files itself */
+    bool passthrough = false;
+
+    /*
+     * Last, so its watcher stops before the members it touches go away;
+     * the destructor stops it before closing `datadirfd`, which it uses.
+     */
+    Scanner scanner;
 
 public:
     TagFS(int argc, char **argv, std::filesystem::path datadir);
+    ~TagFS();
+
+    /* the tables of `.yatagfs.db`, for whatever else writes one */
+    static auto create_schema(SQLite &) -> void;
+
+    auto init(struct fuse_conn_info *) -> void override;
+    auto lookup(fuse_req_t, fuse_ino_t parent, const char *name, struct fuse_entry_param *) -> int override;
+    auto forget(fuse_ino_t, uint64_t nlookup) -> void override;
+    auto getattr(fuse_req_t, fuse_ino_t, struct stat *, struct fuse_file_info *) -> int override;
+    auto setattr(fuse_req_t, fuse_ino_t, struct stat *attr, int to_set, struct stat *out, struct fuse_file_info *) -> int override;
+    auto mkdir(fuse_req_t, fuse_ino_t parent, const char *name, mode_t, struct fuse_entry_param *) -> int override;
+    auto unlink(fuse_req_t, fuse_ino_t parent, const char *name) -> int override;
+    auto rmdir(fuse_req_t, fuse_ino_t parent, const char *name) -> int override;
+    auto rename(fuse_req_t, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) -> int override;
+    auto link(fuse_req_t, fuse_ino_t, fuse_ino_t newparent, const char *newname, struct fuse_entry_param *) -> int override;
+    auto open(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int override;
+    auto read(fuse_req_t, fuse_ino_t, size_t size, off_t off, struct fuse_file_info *, struct fuse_bufvec *buf) -> int override;
+    auto write_buf(fuse_req_t, fuse_ino_t, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *) -> ssize_t override;
+    auto flush(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int override;
+    auto release(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int override;
+    auto fsync(fuse_req_t, fuse_ino_t, int datasync, struct fuse_file_info *) -> int override;
+    auto opendir(fuse_req_t, fuse_ino_t, struct fuse_file_info *) -> int override;
+    auto readdir(fuse_req_t, fuse_ino_t, char *buf, size_t size, off_t off, struct fuse_file_info *) -> ssize_t override;
+    auto readdirplus(fuse_req_t, fuse_ino_t, char *buf, size_t size, off_t off, struct fuse_file_info *) -> ssize_t override;
+    auto create(fuse_req_t, fuse_ino_t parent, const char *name, mode_t, struct fuse_entry_param *, struct fuse_file_info *) -> int override;
+
+private:
+    /*
+     * Whether `dir` shows the tag `tag` rather than files of the same
+     * name. A name in the root is `/q` or `/.yatagfs` first; then a tag
+     * not on the path, outside queries; then a file. `lookup` and `list`
+     * both go by this.
+     */
+    static auto shows_tag(const Node &dir, std::optional<int64_t> tag) -> bool;
+
+    auto node(fuse_ino_t) -> std::optional<Node>;
+    auto intern(fuse_ino_t parent, int64_t tag) -> fuse_ino_t;
+    auto intern_query(const std::string &query) -> fuse_ino_t;
+    /* `/q` or a directory in it */
+    auto read_only(fuse_ino_t) -> bool;
+    auto ref_file(int64_t id) -> void;
+    /* hand the open backing file `fd` of file `id` to the kernel through `fi` */
+    auto open_handle(fuse_req_t, int64_t id, int fd, struct fuse_file_info *) -> void;
+
+    auto dir_attr(fuse_ino_t, struct stat *, bool writable = true) const noexcept -> void;
+    auto stats_attr(struct stat *) const noexcept -> void;
+    /* what `/.yatagfs/stats` reads, see `Stats::report` */
+    auto stats_report() -> std::string;
+    auto file_attr(SQLite &, int64_t id, struct stat *) -> int;
+    auto file_tags(SQLite &, int64_t id) -> std::vector<int64_t>;
+
+    auto tag_id(SQLite &, std::string_view name) -> std::optional<int64_t>;
+    auto file_in(SQLite &, const Node &, std::string_view name) -> std::optional<int64_t>;
+    auto indexed_file_in(SQLite &, const Node &, std::string_view name) -> std::optional<int64_t>;
+
+    /* the same, answered from `cache` when possible */
+    auto cached_attr(int64_t id, struct stat *) -> int;
+    auto cached_tag_id(std::string_view name) -> std::optional<int64_t>;
+    auto cached_file_in(const Node &, std::string_view name) -> std::optional<int64_t>;
+    /* null if `query` does not parse */
+    auto cached_plan(const std::string &query) -> Cache::Plan;
+    /* the first `limit` files `dir` lists after file `after` */
+    auto files_after(const Node &dir, int64_t after, std::size_t limit) -> std::vector<int64_t>;
+    /* readdir, or readdirplus when `plus`, resuming at `off` */
+    auto list(fuse_req_t, fuse_ino_t, char *buf, size_t size, off_t off, bool plus) -> ssize_t;
+
+    /*
+     * Drop cached entries for `name` in every directory that lists the
+     * tags a file called that way gained or lost, and in the root when
+     * the file itself appeared or disappeared.
+     */
+    auto changed_file(std::string_view name, const std::vector<int64_t> &tags, bool root) -> void;
+    /* a tag called `name` appeared or disappeared: it shows up everywhere */
+    auto changed_tag(std::string_view name) -> void;
+
+    /* apply a change made to the data directory behind our back */
+    auto changed_on_disk(const Scanner::Change &) -> void;
+    /* delete these rows; returns what to do once that is committed */
+    auto drop_files(SQLite &, std::vector<std::pair<int64_t, std::string>> files) -> std::function<void()>;
 };
@@ -0,0 +1,127 @@
+/*
+ * `Postings` and `TagIndex` against a `std::set` per tag: random inserts
+ * and erases that move chunks across the array/bitmap threshold both
+ * ways, then every intersection, whole and paged, compared with the
+ * reference.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "check.hxx"
+#include "index.hxx"
+
+static constexpr int rounds = 300;
+static constexpr int64_t tags = 4;
+
+using Reference = std::map<int64_t, std::set<int64_t>>;
+
+static auto expected(const Reference &ref, const std::vector<int64_t> &tags) -> std::vector<int64_t> {
+    std::vector<int64_t> res;
+    for (auto file : ref.at(tags.front())) {
+        if (std::all_of(tags.begin(), tags.end(), [&](int64_t tag) { return ref.at(tag).count(file); }))
+            res.push_back(file);
+    }
+    return res;
+}
+
+/* one chunk filled past `array_max`, then emptied below it again */
+static auto transitions() -> void {
+    Postings set;
+    uint32_t base = 3 << 16;
+    for (uint32_t low = 0; low <= Postings::array_max; low++)
+        CHECK(set.insert(base + low * 7));
+    CHECK(!set.insert(base));
+    CHECK(set.find(3)->is_bitmap());
+    CHECK(set.size() == Postings::array_max + 1);
+
+    CHECK(!set.erase(base + 1));
+    CHECK(set.erase(base + 7));
+    CHECK(!set.find(3)->is_bitmap());
+    CHECK(!set.contains(base + 7));
+    CHECK(set.contains(base + 14));
+
+    for (uint32_t low = 0; low <= Postings::array_max; low++)
+        set.erase(base + low * 7);
+    CHECK(set.size() == 0);
+    CHECK(!set.find(3));
+}
+
+static auto round(std::mt19937_64 &rng) -> void {
+    TagIndex index;
+    Reference ref;
+
+    /* spans up to a few chunks; the narrow ones fill a chunk into a bitmap */
+    static constexpr int64_t spans[] = {6000, 70000, 300000};
+    for (int64_t tag = 1; tag <= tags; tag++) {
+        auto span = spans[rng() % std::size(spans)];
+        auto n = rng() % 12000;
+        auto &files = ref[tag];
+        for (uint64_t i = 0; i < n; i++) {
+            int64_t file = rng() % span + 1;
+            index.add(file, tag);
+            files.insert(file);
+        }
+        /* then some of them go again, bitmaps turning back into arrays */
+        for (auto it = files.begin(); it != files.end();) {
+            if (rng() % 3 == 0) {
+                index.remove(*it, tag);
+                it = files.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    for (int64_t tag = 1; tag <= tags; tag++)
+        CHECK(index.cardinality(tag) == ref[tag].size());
+
+    for (int query = 0; query < 8; query++) {
+        std::vector<int64_t> set;
+        for (int64_t tag = 1; tag <= tags; tag++)
+            if (rng() % 2)
+                set.push_back(tag);
+        if (set.empty())
+            set.push_back(rng() % tags + 1);
+
+        auto want = expected(ref, set);
+        CHECK(index.intersect(set) == want);
+
+        std::vector<int64_t> paged;
+        std::size_t limit = rng() % 300 + 1;
+        for (int64_t after = 0;;) {
+            auto page = index.intersect(set, after, limit);
+            CHECK(page.size() <= limit);
+            paged.insert(paged.end(), page.begin(), page.end());
+            if (page.size() < limit)
+                break;
+            after = page.back();
+        }
+        CHECK(paged == want);
+
+        /* starting anywhere, not only after a listed file */
+        int64_t after = rng() % 300000;
+        auto from = std::upper_bound(want.begin(), want.end(), after);
+        auto rest = std::vector<int64_t>(from, from + std::min<std::ptrdiff_t>(limit, want.end() - from));
+        CHECK(index.intersect(set, after, limit) == rest);
+
+        for (int i = 0; i < 100; i++) {
+            int64_t file = rng() % 300000 + 1;
+            CHECK(index.contains(file, set) == std::binary_search(want.begin(), want.end(), file));
+        }
+    }
+}
+
+auto main() -> int {
+    transitions();
+
+    std::mt19937_64 rng(1);
+    for (int i = 0; i < rounds; i++)
+        round(rng);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * `Query::parse` on edge cases, then `Query::run` and `Query::matches`
+ * on random queries against a brute-force evaluation of the same plan
+ * over a random `TagIndex`, whole and paged.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "check.hxx"
+#include "query.hxx"
+
+static constexpr int rounds = 300;
+static constexpr int64_t files = 3000;
+static constexpr int64_t tags = 6;
+
+using Terms = std::vector<std::pair<std::vector<std::string>, std::vector<std::string>>>;
+
+static auto parsed(const char *text) -> Terms {
+    auto query = Query::parse(text);
+    CHECK(query);
+    Terms terms;
+    for (auto &term : query->terms)
+        terms.emplace_back(term.all, term.none);
+    return terms;
+}
+
+static auto parsing() -> void {
+    CHECK(parsed("a") == Terms({{{"a"}, {}}}));
+    CHECK(parsed("jazz+flac-live,blues") == Terms({{{"jazz", "flac"}, {"live"}}, {{"blues"}, {}}}));
+    CHECK(parsed("-a-b,c") == Terms({{{}, {"a", "b"}}, {{"c"}, {}}}));
+    CHECK(parsed("a-b+c") == Terms({{{"a", "c"}, {"b"}}}));
+    CHECK(parsed("hip\\-hop") == Terms({{{"hip-hop"}, {}}}));
+    CHECK(parsed("a\\,b\\\\") == Terms({{{"a,b\\"}, {}}}));
+
+    for (auto bad : {"", "+a", "a+", "a-", "a,", ",a", "a,,b", "a--b", "a+-b", "a-+b", "--a", "a\\"})
+        CHECK(!Query::parse(bad));
+}
+
+static auto tag_name(int64_t tag) -> std::string {
+    return "t" + std::to_string(tag);
+}
+
+static auto round(std::mt19937_64 &rng) -> void {
+    TagIndex index;
+    std::map<int64_t, std::set<int64_t>> ref;
+    for (int64_t tag = 1; tag <= tags; tag++) {
+        /* some tags on most files, some on a few, one now and then on none */
+        auto odds = rng() % 20;
+        for (int64_t file = 1; file <= files; file++) {
+            if (odds && rng() % 20 < odds) {
+                index.add(file, tag);
+                ref[tag].insert(file);
+            }
+        }
+    }
+
+    /* up to three alternatives of a few tags each, one of which may not exist */
+    std::string text;
+    for (int term = rng() % 3; term >= 0; term--) {
+        if (!text.empty())
+            text += ',';
+        auto n = rng() % 3 + 1;
+        for (uint64_t i = 0; i < n; i++) {
+            char op = i ? "+-"[rng() % 2] : "\0-"[rng() % 4 == 0];
+            if (op)
+                text += op;
+            text += tag_name(rng() % (tags + 1) + 1);
+        }
+    }
+
+    auto query = Query::parse(text);
+    CHECK(query);
+    auto plan = query->plan([&](std::string_view name) -> std::optional<int64_t> {
+        for (int64_t tag = 1; tag <= tags; tag++)
+            if (name == tag_name(tag))
+                return tag;
+        return {};
+    });
+
+    auto carries = [&](int64_t file, int64_t tag) { return ref[tag].count(file) > 0; };
+    std::vector<int64_t> want;
+    for (int64_t file = 1; file <= files; file++) {
+        bool match = std::any_of(plan.any.begin(), plan.any.end(), [&](auto &conj) {
+            return std::all_of(conj.all.begin(), conj.all.end(), [&](int64_t tag) { return carries(file, tag); })
+                && std::none_of(conj.none.begin(), conj.none.end(), [&](int64_t tag) { return carries(file, tag); });
+        });
+        if (match)
+            want.push_back(file);
+        CHECK(Query::matches(plan, index, file) == match);
+    }
+
+    auto everything = [&](int64_t after, std::size_t limit) {
+        std::vector<int64_t> res;
+        for (int64_t file = after + 1; file <= files && res.size() < limit; file++)
+            res.push_back(file);
+        return res;
+    };
+
+    CHECK(Query::run(plan, index, everything) == want);
+
+    std::vector<int64_t> paged;
+    std::size_t limit = rng() % 200 + 1;
+    for (int64_t after = 0;;) {
+        auto page = Query::run(plan, index, everything, after, limit);
+        CHECK(page.size() <= limit);
+        paged.insert(paged.end(), page.begin(), page.end());
+        if (page.size() < limit)
+            break;
+        after = page.back();
+    }
+    CHECK(paged == want);
+}
+
+auto main() -> int {
+    parsing();
+
+    std::mt19937_64 rng(1);
+    for (int i = 0; i < rounds; i++)
+        round(rng);
+    return 0;
+}